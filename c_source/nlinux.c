@@ -18,27 +18,166 @@
  * Dependencies:
  * - GTK3 development libraries
  * - pthread library
- * - Standard Linux utilities (lspci, apt-get, lsb-release, etc.)
+ * - Standard Linux utilities (apt-get, dpkg, wget, etc.)
  */
 
+#define _GNU_SOURCE
+
 #include <gtk/gtk.h>
 #include <glib.h>
+#include <gio/gio.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/utsname.h>
 #include <pthread.h>
 #include <errno.h>
 #include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stddef.h>
 
 // Application constants
 #define APP_TITLE "NVIDIA GPU Setup Tool"
 #define APP_VERSION "1.1"
-#define MAX_CMD_OUTPUT 8192
-#define MAX_LOG_LINES 1000
-#define DETECTION_DELAY_NS 500000000 // 0.5 seconds
+#define COMMAND_READ_CHUNK (64 * 1024)
+#define SHELL_METACHARACTERS "|&;<>()$`*?[~\n"
+#define APP_STATE_SUBDIR "nvidia-setup-tool"    // Under the user state dir
+
+// Streaming command output to the console
+#define OUTPUT_LINE_MAX 4096                    // Longer lines are split
+#define OUTPUT_TAIL_LINES 20                    // Repeated in the console when a command fails
+
+// Worker threads reach the console and progress bar through the log ring
+#define LOG_RING_CAPACITY 2048                  // Power of two
+#define LOG_EVENT_TEXT_MAX 512                  // Longer messages are truncated
+#define LOG_DRAIN_INTERVAL_MS 33
+
+// On-disk install journal, one JSON object per line
+#define JOURNAL_DIR "/var/log/nvidia-setup-tool"    // Prepared by the privileged helper
+#define JOURNAL_FILE_NAME "install.jsonl"
+#define JOURNAL_ROTATE_BYTES (8 * 1024 * 1024)
+#define JOURNAL_KEEP_ROTATED 10                     // Compressed journals kept per directory
+#define JOURNAL_BATCH_MAX 512                       // Records per write()
+
+// Resumable installs, the resolved packages and steps nothing can verify are checkpointed until
+// the plan finishes
+#define INSTALL_CHECKPOINT_FILE "install-state.ini"
+#define INSTALL_DOWNLOAD_DIR "downloads"            // Kept with the checkpoint for a resumed install
+#define CUDA_ENV_FILE "/etc/profile.d/cuda.sh"
+#define INSTALL_PLAN_MAX_STEPS 64                   // Dependencies are a bit mask
+
+// Progress bar, each step weighted by how long it is expected to take
+#define INSTALL_TIMEOUT_HEADROOM 10                 // Timeouts allow about this many times the usual duration
+#define PROGRESS_POST_INTERVAL_US (100 * 1000)      // apt reports far more often than the bar can show
+#define APT_ASSUMED_DOWNLOAD_BPS (20.0 * 1000 * 1000)   // Sizes the download and dpkg phases
+#define APT_ASSUMED_UNPACK_BPS (100.0 * 1000 * 1000)
+#define APT_ASSUMED_SECONDS_PER_PACKAGE 0.5
+#define THROUGHPUT_SAMPLE_US (G_USEC_PER_SEC / 2)
+#define THROUGHPUT_SMOOTHING 0.3                    // Weight of the newest sample
+
+// Durations of earlier runs on this machine, for progress weights and time estimates
+#define STEP_HISTORY_FILE "step-history.ini"
+#define STEP_HISTORY_SMOOTHING 0.3                  // Weight of the newest run
+#define STEP_HISTORY_MIN_DOWNLOAD_S 1.0             // Shorter downloads say little about bandwidth
+
+// Installed packages, read straight from dpkg's database
+#define DPKG_STATUS_PATH "/var/lib/dpkg/status"
+#define DPKG_INDEX_MIN_SLOTS 4096                   // Power of two
+
+// Driver branch, toolkit and keyring, picked from the lists apt-get update downloaded
+#define APT_LISTS_DIR "/var/lib/apt/lists"
+#define APT_INDEX_MIN_SLOTS 256                     // Power of two, only NVIDIA packages are indexed
+#define CUDA_KEYRING_FALLBACK_DEB "cuda-keyring_1.1-1_all.deb"    // Until NVIDIA's lists name one
+#define CUDA_DRIVERS_FALLBACK "cuda-drivers"        // Metapackages tracking the newest release
+#define CUDA_TOOLKIT_FALLBACK "cuda-toolkit"
+
+// Package index freshness, apt-get update is skipped or narrowed to the sources that need it
+#define APT_SOURCES_LIST "/etc/apt/sources.list"
+#define APT_SOURCES_DIR "/etc/apt/sources.list.d"
+#define APT_UPDATE_STAMP "/var/lib/apt/periodic/update-success-stamp"  // Touched by every successful update
+#define APT_SOURCES_STATE_FILE "apt-sources.ini"
+#define APT_LISTS_MAX_AGE_S (6 * 60 * 60)
+#define PREREQUISITE_PACKAGES "software-properties-common apt-transport-https ca-certificates curl wget " \
+                              "gnupg lsb-release build-essential dkms"
+#define BOOTSTRAP_PACKAGES "wget ca-certificates"   // Needed before the keyring download
+#define TRANSACTION_PREVIEW_MAX 25                  // Packages named in the preview dialog
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34))
+#define HAVE_SPAWN_ADDCLOSEFROM 1
+#endif
+
+// Command deadlines and cancellation
+#define COMMAND_TIMED_OUT (-2)                  // execute_command results, never a real exit code
+#define COMMAND_CANCELLED (-3)
+#define COMMAND_KILL_GRACE_MS 5000              // SIGTERM to SIGKILL
+#define COMMAND_DRAIN_GRACE_MS 500              // Output still read after the child exited
+#define COMMAND_REAP_INTERVAL_MS 100            // waitpid polling when pidfd_open is unavailable
+#define TIMEOUT_QUICK_S 60
+#define TIMEOUT_DOWNLOAD_S (10 * 60)
+#define TIMEOUT_APT_UPDATE_S (10 * 60)
+#define TIMEOUT_APT_INSTALL_S (60 * 60)
+#define TIMEOUT_TOOLKIT_INSTALL_S (90 * 60)
+#define APT_STATUS_FD 3                         // apt's machine readable progress, see APT::Status-Fd
+
+// Root helper started once per session, see start_privileged_helper
+#define PRIVILEGED_HELPER_FLAG "--privileged-helper"
+#define HELPER_CONNECT_TIMEOUT_MS 60000         // Covers slow PAM stacks
+#define HELPER_FRAME_MAX (1024 * 1024)
+#define HELPER_CANCEL_POLL_MS 100
+#define HELPER_RUN_STATUS_FD 0x1                // HELPER_FRAME_RUN flag: give the command APT_STATUS_FD
+
+// Console transcript, dropped a whole chunk at a time once full
+#define CONSOLE_CHUNK_LINES 1024
+#define CONSOLE_MAX_CHUNKS 256                  // 262144 lines
+#define CONSOLE_CHUNK_TEXT_INITIAL (64 * 1024)
+#define CONSOLE_LINE_MAX (LOG_EVENT_TEXT_MAX + 32)  // Message plus timestamp and status prefix
+#define CONSOLE_PADDING 6                       // Pixels around the text
+#define CONSOLE_SCROLL_LINES 3                  // Per mouse wheel step
+#define CONSOLE_BLOOM_SHIFT 14                  // 2^14 bit trigram filter per chunk, 2 KiB
+#define CONSOLE_BLOOM_BITS (1u << CONSOLE_BLOOM_SHIFT)
+
+// Hidden console benchmark, run with --benchmark-console or make bench
+#define CONSOLE_BENCHMARK_FLAG "--benchmark-console"
+#define CONSOLE_BENCHMARK_SECONDS 5
+#define CONSOLE_BENCHMARK_SLOW_FRAME_US 33334   // Two frames at 60 Hz
+
+// PCI enumeration
+#define SYSFS_PCI_DEVICES_DIR "/sys/bus/pci/devices"
+#define NVIDIA_PCI_VENDOR_ID 0x10de
+#define PCI_BASE_CLASS_DISPLAY 0x03
+
+// Driver version sources
+#define PROC_NVIDIA_DRIVER_DIR "/proc/driver/nvidia"
+#define SYSFS_NVIDIA_MODULE_DIR "/sys/module/nvidia"
+
+// CUDA toolkit discovery
+#define CUDA_DEFAULT_PREFIX "/usr/local/cuda"
+#define CUDA_OPT_SEARCH_DEPTH 5
+
+// Disk space preflight
+#define MIB (1024ULL * 1024ULL)
+#define GIB (1024ULL * MIB)
+
+// Secure Boot state, read straight from the EFI variables
+#define EFI_FIRMWARE_DIR "/sys/firmware/efi"
+#define EFI_FIRMWARE_DIR_ENV "NVIDIA_SETUP_EFI_DIR"      // Points the check at a fake tree for testing
+#define EFI_GLOBAL_VARIABLE_GUID "8be4df61-93ca-11d2-aa0d-00e098032b8c"
+
+// Distribution detection
+#define OS_RELEASE_PATH "/etc/os-release"
+#define OS_RELEASE_FALLBACK_PATH "/usr/lib/os-release"
 
 // Status types
 typedef enum {
@@ -46,20 +185,246 @@ typedef enum {
     STATUS_SUCCESS,
     STATUS_WARNING,
     STATUS_ERROR,
-    STATUS_INFO
+    STATUS_INFO,
+    STATUS_TYPE_COUNT
 } StatusType;
 
+// One NVIDIA display or 3D controller found on the PCI bus
+typedef struct {
+    gchar bdf[16];              // domain:bus:device.function, e.g. 0000:01:00.0
+    guint16 device_id;
+    guint16 subsys_vendor_id;
+    guint16 subsys_device_id;
+    guint32 class_code;
+    gint numa_node;             // -1 when the platform reports no NUMA affinity
+    gint iommu_group;           // -1 when the IOMMU is disabled
+    gchar *model_name;
+} GpuDevice;
+
+// One CUDA toolkit installation found on disk
+typedef struct {
+    gchar *path;                // Canonical install prefix
+    gchar *version;             // Toolkit version, e.g. 12.6.2
+    gchar **components;         // "name version" pairs from version.json, NULL for version.txt installs
+    gboolean is_default;        // Target of /usr/local/cuda
+} CudaToolkit;
+
+// Facts about the running host that cannot change while the process is alive
+typedef struct {
+    struct utsname uts;
+    gchar *kernel_release;      // /proc/sys/kernel/osrelease
+    gchar *proc_version;        // /proc/version
+    gboolean is_wsl;
+    const gchar *cuda_repo_arch; // Architecture directory in NVIDIA's repository, NULL if none
+} HostFacts;
+
+// Receives command output line by line while the command runs
+typedef struct {
+    void (*line)(gpointer user_data, const gchar *line, gboolean is_stderr);
+    gpointer user_data;
+} CommandSink;
+
+// Cancels every command that watches it; the read end stays readable once cancelled
+typedef struct {
+    gint fds[2];
+    gint cancelled;
+} CancelToken;
+
+// A command to spawn directly from an argv array
+typedef struct {
+    const gchar *const *argv;
+    const gchar *input;         // Written to stdin, NULL for /dev/null
+    GString *out;               // Captured stdout, NULL to discard
+    GString *err;               // Captured stderr, NULL to discard
+    const CommandSink *sink;    // Streams output lines as they arrive, NULL to skip
+    gint timeout_ms;            // Kill the process group after this long, 0 for no limit
+    const CancelToken *cancel;  // Kills the process group when cancelled, NULL to ignore
+    const CommandSink *status;  // Lines the command writes to APT_STATUS_FD, NULL to not open it
+} CommandRequest;
+
+// Messages between the app and the root helper, each a HelperFrameHeader plus payload
+typedef enum {
+    HELPER_FRAME_HELLO,         // helper -> app, once after connecting
+    HELPER_FRAME_RUN,           // app -> helper: guint32 timeout_ms, guint32 HELPER_RUN_ flags, then NUL-terminated argv strings
+    HELPER_FRAME_CANCEL,        // app -> helper
+    HELPER_FRAME_STDOUT,        // helper -> app: one output line
+    HELPER_FRAME_STDERR,
+    HELPER_FRAME_STATUS,        // helper -> app: one line from APT_STATUS_FD
+    HELPER_FRAME_EXIT           // helper -> app: gint32 execute_command result
+} HelperFrameType;
+
+typedef struct {
+    guint32 length;             // Payload bytes after the header
+    guint32 request_id;
+    guint32 type;
+} HelperFrameHeader;
+
+// Helper side: one running command
+typedef struct {
+    struct HelperServer *server;
+    guint32 id;
+    gchar **argv;
+    gint timeout_ms;
+    gboolean status_fd;         // HELPER_RUN_STATUS_FD
+    CancelToken cancel;
+} HelperJob;
+
+// Helper side: the connection back to the app
+typedef struct HelperServer {
+    gint socket_fd;
+    GMutex lock;                // Guards socket writes and jobs
+    GCond idle;                 // Signalled when the last job finishes
+    GHashTable *jobs;           // request id -> HelperJob
+} HelperServer;
+
+// App side: one command waiting for the helper
+typedef struct {
+    const CommandRequest *request;
+    gint status;
+    gboolean done;
+} PrivilegedCall;
+
+// App side: the running helper
+typedef struct {
+    gint socket_fd;
+    gboolean alive;
+    GMutex lock;                // Guards socket writes, calls and alive
+    GCond call_done;
+    GHashTable *calls;          // request id -> PrivilegedCall
+    guint32 next_id;
+    pthread_t reader_thread;
+    pthread_t launcher_thread;  // Waits on sudo for as long as the helper lives
+    gchar **launch_argv;
+    gchar *launch_input;        // Password line, wiped once sudo has read it
+    GString *launch_err;
+    CancelToken launch_cancel;
+    gint launch_finished;
+} PrivilegedHelper;
+
+// Secure Boot state as seen by the firmware
+typedef enum {
+    SECURE_BOOT_UNKNOWN,        // EFI boot, but the variables could not be read
+    SECURE_BOOT_LEGACY_BIOS,
+    SECURE_BOOT_DISABLED,
+    SECURE_BOOT_SETUP_MODE,     // Enabled but no platform key enrolled, so nothing is enforced
+    SECURE_BOOT_ENABLED
+} SecureBootState;
+
+// Space an install writes under one directory, per selected component
+typedef struct {
+    const gchar *path;
+    guint64 base_bytes;         // Package lists and prerequisites
+    guint64 driver_bytes;
+    guint64 cuda_bytes;
+} DiskRequirement;
+
 // System detection results
 typedef struct {
     gboolean gpu_detected;
     gchar *gpu_info;
+    GArray *gpus;               // GpuDevice records from the last PCI scan
     gboolean driver_installed;
     gchar *driver_info;
+    gchar *driver_kernel_version;       // Loaded kernel module, NULL if not loaded
+    gchar *driver_userspace_version;    // Installed libnvidia-ml, NULL if not found
+    gboolean driver_version_mismatch;
     gboolean cuda_installed;
     gchar *cuda_info;
-    gchar *distro_codename;
+    GArray *cuda_toolkits;      // CudaToolkit records, newest first
+    gchar *os_id;               // os-release ID, e.g. ubuntu
+    gchar *os_version_id;       // os-release VERSION_ID, e.g. 22.04
+    gchar *os_id_like;          // os-release ID_LIKE, e.g. "ubuntu debian"
+    gchar *distro_codename;     // os-release VERSION_CODENAME
+    gchar *upstream_codename;   // Ubuntu/Debian codename a derivative is based on
+    gchar *nvidia_repo_id;      // CUDA repository directory, e.g. ubuntu2204, NULL if unsupported
 } SystemInfo;
 
+// What a log event asks the main thread to do
+typedef enum {
+    LOG_EVENT_LINE,             // Append text to the console
+    LOG_EVENT_PROGRESS          // Move the progress bar to progress and show text as its label
+} LogEventKind;
+
+// One pre-allocated slot of the log ring, filled in place by the producer that claims it
+typedef struct {
+    guint sequence;             // Slot state for the queue protocol, see log_ring_claim
+    LogEventKind kind;
+    StatusType type;
+    gdouble progress;           // Percent, LOG_EVENT_PROGRESS only
+    gint64 timestamp;           // Wall clock time of posting, microseconds
+    gchar text[LOG_EVENT_TEXT_MAX];
+} LogEvent;
+
+// Bounded multi-producer, single-consumer queue of log events. Any thread posts,
+// the main thread drains it on a timer, nothing is allocated per event.
+typedef struct {
+    LogEvent slots[LOG_RING_CAPACITY];
+    guint enqueue_pos;          // Claimed by producers with a compare-and-swap
+    gchar enqueue_padding[64];  // Keeps producers and the consumer off each other's cache line
+    guint dequeue_pos;          // Main thread only
+    guint dropped;              // Events lost because the ring was full, reset by each drain
+    guint dropped_total;        // Main thread only, every drop drained so far
+} LogRing;
+
+typedef enum {
+    JOURNAL_RECORD_LOG,         // A console message
+    JOURNAL_RECORD_OUTPUT,      // A line of command output
+    JOURNAL_RECORD_STEP_BEGIN,
+    JOURNAL_RECORD_STEP_END,    // Written with fsync
+    JOURNAL_RECORD_RELOCATE,    // Move to JOURNAL_DIR if it became writable
+    JOURNAL_RECORD_STOP
+} JournalRecordKind;
+
+typedef struct {
+    JournalRecordKind kind;
+    StatusType type;
+    gboolean is_stderr;
+    gint result;                // JOURNAL_RECORD_STEP_END
+    gint64 timestamp;
+    gchar *text;                // Message, output line or step name
+} JournalRecord;
+
+// Appends records on its own thread so nothing else ever waits for the disk
+typedef struct {
+    GAsyncQueue *queue;         // JournalRecord
+    pthread_t writer_thread;
+    gchar *directory;
+    gchar *path;
+    gint fd;
+    gsize size;
+    guint64 sequence;
+    gboolean write_failed;      // Reported once on stderr
+} Journal;
+
+// A run of CONSOLE_CHUNK_LINES console lines stored back to back
+typedef struct {
+    gchar *text;                // Not NUL-terminated, line i is text[offsets[i]..offsets[i + 1])
+    gsize text_length;
+    gsize text_capacity;
+    guint32 offsets[CONSOLE_CHUNK_LINES + 1];
+    guint8 types[CONSOLE_CHUNK_LINES];  // StatusType per line
+    guint count;
+    guint64 trigrams[CONSOLE_BLOOM_BITS / 64];  // Bloom filter of the case-folded trigrams in text
+} ConsoleChunk;
+
+// Append-only console transcript; every chunk but the last is full
+typedef struct {
+    GPtrArray *chunks;          // ConsoleChunk, oldest first
+    guint64 first_line;         // Number of the oldest stored line since startup
+    guint line_count;
+    GArray *severity_lines[STATUS_TYPE_COUNT];  // guint64 line numbers of each StatusType, oldest first
+} ConsoleStore;
+
+// Which console lines are shown; kept up to date as lines arrive instead of rescanning
+typedef struct {
+    gint severity;              // StatusType to show, -1 for all
+    gchar *query;               // Case-folded search text, or the pattern in regex mode, NULL for none
+    GRegex *regex;
+    gboolean invalid;           // Regex did not compile, nothing matches
+    GArray *rows;               // guint64 line numbers that pass, NULL when nothing is filtered
+    guint64 scanned_until;      // Lines before this one have been tested
+} ConsoleFilter;
+
 // Application state
 typedef struct {
     GtkWidget *main_window;
@@ -71,34 +436,248 @@ typedef struct {
     GtkWidget *cuda_icon_label;
     GtkWidget *install_driver_check;
     GtkWidget *install_cuda_check;
+    GtkWidget *preview_packages_check;
     GtkWidget *detect_button;
     GtkWidget *install_button;
+    GtkWidget *cancel_button;
     GtkWidget *progress_bar;
     GtkWidget *progress_label;
-    GtkWidget *console_textview;
+    GtkWidget *console_view;        // Draws only the rows of console_store that are on screen
+    GtkWidget *console_severity_combo;
+    GtkWidget *console_search_entry;
+    GtkWidget *console_regex_check;
     GtkWidget *progress_frame;
-    GtkTextBuffer *console_buffer;
+    GtkAdjustment *console_adjustment;  // Value is the top row, upper is the stored line count
+    PangoLayout *console_layout;
+    gint console_row_height;
+    ConsoleStore console_store;
+    guint64 console_synced_first_line;  // console_store.first_line at the last flush_console
+    ConsoleFilter console_filter;
+    guint64 console_lines_total;    // Lines ever appended
+    gint64 console_stamp_second;    // Second console_stamp was formatted for
+    gchar console_stamp[16];
     
     SystemInfo system_info;
     gboolean installation_running;
+    gboolean preview_transaction;   // Ask before the package transaction runs
+    CancelToken cancel;         // Cancels the running install and any detection commands
+    LogRing log_ring;
+    Journal *journal;           // NULL in benchmark mode
+    PrivilegedHelper *helper;   // Runs root commands, NULL until the user authenticates
+    gchar *helper_password;     // From the password dialog until installation_thread starts the helper
     pthread_t worker_thread;
 } AppData;
 
 // Global application data
 static AppData *app_data = NULL;
 
-// Progress update structure for thread communication
+// State of a --benchmark-console run
+typedef struct {
+    AppData *app_data;
+    pthread_t producer;
+    gint stop;
+    guint64 lines_posted;
+    gint64 start_us;
+    gint64 last_frame_us;
+    gint64 max_frame_gap_us;
+    guint frames;
+    guint slow_frames;
+} ConsoleBenchmark;
+
+// Per-command state of the console output stream
+typedef struct {
+    AppData *app_data;
+    gchar tail[OUTPUT_TAIL_LINES][LOG_EVENT_TEXT_MAX];  // Last lines, kept even if the ring dropped them
+    guint tail_next;
+} ConsoleStream;
+
+// Detection probes, all started at once by detection_thread
+typedef enum {
+    PROBE_DISTRO,
+    PROBE_GPU,
+    PROBE_DRIVER,
+    PROBE_CUDA,
+    PROBE_COUNT
+} ProbeKind;
+
+typedef struct {
+    const gchar *name;
+    const gchar *start_message;
+    gboolean (*detect)(SystemInfo *info);
+    GSourceFunc update_card;        // Main-thread card refresh, NULL if the probe has no card
+} ProbeSpec;
+
+typedef struct {
+    AppData *app_data;
+    const ProbeSpec *spec;
+    pthread_t thread;
+    gboolean result;
+    gint64 elapsed_us;
+    GAsyncQueue *done_queue;
+} ProbeTask;
+
+// What install steps compete for; steps run together while every resource has room
+typedef enum {
+    INSTALL_RESOURCE_DPKG,      // dpkg and apt locks, one holder
+    INSTALL_RESOURCE_NETWORK,   // Downloads
+    INSTALL_RESOURCE_CPU,       // Kernel module builds
+    INSTALL_RESOURCE_COUNT
+} InstallResource;
+
+#define INSTALL_USES(resource) (1u << (resource))
+
+// One step of the install plan. A step whose verify finds the work already done is skipped,
+// so an install that stopped part way resumes where it left off. Work verify cannot see, such
+// as a download, is recorded in the checkpoint instead.
+typedef struct {
+    const gchar *id;            // Step history and checkpoint key, named by depends
+    const gchar *label;         // Progress bar text
+    const gchar *message;       // Console text when the step starts
+    gchar *command;             // NULL for a resolves step, run_resolve_step runs the simulations
+    gint timeout_seconds;
+    gboolean as_root;
+    gboolean (*verify)(const gchar *arg);
+    gchar *verify_arg;
+    guint resources;            // INSTALL_USES bits
+    guint64 depends;            // Bit i: waits for plan step i, always an earlier step
+    gboolean refreshes_lists;   // apt-get update, narrowed to the stale sources when it runs
+    struct PackageSelection *resolves; // Re-resolved and simulated instead of running command
+    guint64 download_bytes;     // Filled in by the resolve step for the packages step
+    guint package_count;
+    gchar *artifact;            // Absolute path the step downloads to, removed when the plan ends
+    gboolean checkpointed;      // Completion recorded in the checkpoint, the artifact has to exist too
+} InstallStep;
+
+// What the packages step installs, NULL for a part that was not selected
+typedef struct PackageSelection {
+    gboolean install_driver;
+    gboolean install_cuda;
+    gchar *driver;              // cuda-drivers-NNN, pins the driver branch
+    gchar *driver_modules;      // Precompiled kernel modules for that branch, NULL to build with DKMS
+    gchar *toolkit;             // cuda-toolkit-X-Y
+    gchar *keyring_deb;         // File name of the keyring package in NVIDIA's repository
+    gboolean pinned;            // Resolved by an interrupted run, installed as is
+} PackageSelection;
+
+// One stanza of a dpkg status or apt Packages file; the strings point into the mapping, not
+// NUL-terminated
+typedef struct {
+    const gchar *name;          // NULL for an empty slot
+    const gchar *version;
+    const gchar *status;        // dpkg only, e.g. "install ok installed"
+    const gchar *filename;      // apt only, path in the repository
+    const gchar *modaliases;    // apt only, the devices a driver package claims
+    const gchar *depends;       // apt only
+    guint32 name_length;
+    guint32 version_length;
+    guint32 status_length;
+    guint32 filename_length;
+    guint32 modaliases_length;
+    guint32 depends_length;
+    guint32 hash;
+} PackageStanza;
+
+// Package name -> stanza, open addressing with linear probing
+typedef struct {
+    PackageStanza *slots;
+    guint capacity;             // Power of two
+    guint count;
+} PackageIndex;
+
+typedef struct {
+    GMappedFile *file;
+    PackageIndex packages;
+    struct stat source;         // Identity of the mapped file, a different one means reload
+} DpkgStatusIndex;
+
+// Every *_Packages list, mapped for as long as the index points into them
+typedef struct {
+    GPtrArray *files;           // GMappedFile
+    PackageIndex packages;
+    struct stat source;         // The lists directory when loaded, apt-get update changes its mtime
+} AptListsIndex;
+
+// What one apt-get install of every selected package would do, from a simulated run
+typedef struct {
+    GPtrArray *installs;        // "name version" of each Inst line
+    GPtrArray *removals;        // Package names of Remv lines
+    guint64 download_bytes;
+} AptTransaction;
+
+// A question for the main thread, the asking worker waits for the answer
 typedef struct {
     AppData *app_data;
-    gdouble progress;
     gchar *message;
-    gchar *log_message;
-    StatusType log_type;
-} ProgressUpdate;
+    gboolean answered;
+    gboolean accepted;
+    GMutex lock;
+    GCond cond;
+} TransactionPreview;
+
+// Configured apt sources and which of them have not been fetched recently
+typedef struct {
+    GHashTable *digests;        // Source file path -> SHA-256 of its contents
+    GPtrArray *stale;           // Paths new, changed or not fetched within APT_LISTS_MAX_AGE_S
+} AptSources;
+
+typedef enum {
+    INSTALL_STEP_PENDING,
+    INSTALL_STEP_RUNNING,
+    INSTALL_STEP_DONE,
+    INSTALL_STEP_SKIPPED,       // Verified as done
+    INSTALL_STEP_FAILED
+} InstallStepState;
+
+// Runs plan steps on worker threads as soon as their dependencies and resources allow
+typedef struct {
+    AppData *app_data;
+    GArray *plan;
+    GKeyFile *checkpoint;       // Guarded by lock
+    GMutex lock;
+    GCond changed;
+    guint resources_used[INSTALL_RESOURCE_COUNT];
+    InstallStepState states[INSTALL_PLAN_MAX_STEPS];
+    gint64 started_us[INSTALL_PLAN_MAX_STEPS];
+    gint64 finished_us[INSTALL_PLAN_MAX_STEPS];
+    pthread_t threads[INSTALL_PLAN_MAX_STEPS];
+    guint running;
+    guint finished;
+    gint failed_index;          // First failed step, -1 while none
+    GKeyFile *history;          // Guarded by lock, see record_step_history
+    gdouble weights[INSTALL_PLAN_MAX_STEPS];    // Expected seconds
+    gdouble fractions[INSTALL_PLAN_MAX_STEPS];  // How far each step is, 0 to 1
+    gdouble remaining[INSTALL_PLAN_MAX_STEPS];  // Seconds left of each running step
+    gdouble progress;           // Percent last shown, it never goes back
+    gint64 progress_posted_us;
+    gchar progress_label[LOG_EVENT_TEXT_MAX];
+} InstallScheduler;
+
+// One apt command's Status-Fd records, turned into progress of its plan step
+typedef struct {
+    InstallScheduler *scheduler;
+    guint index;
+    gdouble download_share;     // Of the step; the rest is dpkg unpacking and configuring
+    guint64 download_bytes;     // Expected archive bytes, 0 if not known
+    gdouble download_seconds;   // Predicted length of each phase
+    gdouble install_seconds;
+    gdouble download_percent;
+    gdouble install_percent;
+    gint64 download_started_us;
+    gint64 download_finished_us; // First pmstatus line, 0 while still downloading
+    gint64 sample_us;           // Last throughput sample
+    gdouble sample_bytes;
+    gdouble bytes_per_second;   // Smoothed, 0 until measured
+} AptStatusProgress;
+
+typedef struct {
+    InstallScheduler *scheduler;
+    guint index;
+} InstallStepTask;
 
 // Function prototypes
 static void init_app_data(AppData *data);
 static gboolean set_widget_sensitive_wrapper(gpointer data);
+static gboolean set_widget_insensitive_wrapper(gpointer data);
 static gboolean set_button_label_wrapper(gpointer data);
 static void create_main_window(AppData *data);
 static void create_header_section(GtkWidget *container);
@@ -109,30 +688,203 @@ static void create_buttons_section(GtkWidget *container, AppData *data);
 static void setup_css_styling(void);
 static void on_detect_clicked(GtkWidget *widget, AppData *data);
 static void on_install_clicked(GtkWidget *widget, AppData *data);
+static void on_cancel_clicked(GtkWidget *widget, AppData *data);
 static void *detection_thread(void *arg);
 static void *installation_thread(void *arg);
+static void *probe_thread(void *arg);
+static GArray *build_install_plan(AppData *data, PackageSelection *selection, const gchar *download_dir);
+static void add_install_step(GArray *plan, const gchar *id, const gchar *label, const gchar *message,
+                             gchar *command, gint timeout_seconds, gboolean as_root,
+                             gboolean (*verify)(const gchar *arg), const gchar *verify_arg,
+                             guint resources, const gchar *depends);
+static void add_apt_update_step(GArray *plan, const gchar *id, const gchar *message, const gchar *depends);
+static gboolean run_resolve_step(AppData *data, GArray *plan, const InstallStep *step);
+static gboolean resolve_apt_transaction(AppData *data, const gchar *packages, AptTransaction *transaction);
+static void parse_apt_simulation(const gchar *output, AptTransaction *transaction);
+static guint64 parse_apt_print_uris(const gchar *output);
+static void clear_apt_transaction(AptTransaction *transaction);
+static gboolean confirm_apt_transaction(AppData *data, const AptTransaction *transaction);
+static gboolean show_transaction_preview(gpointer user_data);
+static const InstallStep *run_install_plan(AppData *data, GArray *plan, GKeyFile *checkpoint);
+static gboolean install_step_ready(const InstallScheduler *scheduler, guint index);
+static void set_step_progress(InstallScheduler *scheduler, guint index, gdouble fraction, gdouble remaining,
+                              const gchar *label, gboolean force);
+static void init_apt_status_progress(AptStatusProgress *progress, InstallScheduler *scheduler, guint index);
+static void apt_status_line(gpointer user_data, const gchar *line, gboolean is_stderr);
+static gdouble apt_transaction_seconds(guint64 download_bytes, guint package_count, gdouble *download_seconds);
+static gdouble predict_step_seconds(GKeyFile *history, const InstallStep *step, gdouble *download_seconds);
+static void record_step_history(GKeyFile *history, const InstallStep *step, gdouble seconds, gdouble download_seconds);
+static gchar *step_history_path(void);
+static GKeyFile *load_step_history(void);
+static void save_step_history(GKeyFile *history);
+static gchar *format_duration(gdouble seconds);
+static void *install_step_thread(void *arg);
+static void report_critical_path(const InstallScheduler *scheduler);
+static void clear_install_step(gpointer data);
+static InstallStep *plan_last_step(GArray *plan);
+static gchar *install_checkpoint_path(void);
+static GKeyFile *load_install_checkpoint(AppData *data, PackageSelection *selection);
+static void checkpoint_package_selection(GKeyFile *checkpoint, const PackageSelection *selection);
+static void save_install_checkpoint(GKeyFile *checkpoint);
+static gboolean packages_installed(const gchar *packages);
+static gboolean dpkg_package_installed(const gchar *name, gsize name_length, gchar **version);
+static gboolean refresh_dpkg_status_index(void);
+static gchar *apt_candidate_version(const gchar *name, gsize name_length);
+static void refresh_apt_lists_index(void);
+static void merge_dpkg_stanza(PackageStanza *existing, const PackageStanza *candidate);
+static gboolean stanza_is_installed(const PackageStanza *stanza);
+static void index_package_stanzas(PackageIndex *index, const gchar *contents, gsize length,
+                                  gboolean (*wanted)(const gchar *name, gsize length),
+                                  void (*merge)(PackageStanza *existing, const PackageStanza *candidate));
+static void init_package_index(PackageIndex *index, guint capacity);
+static void clear_package_index(PackageIndex *index);
+static void insert_package_stanza(PackageIndex *index, const PackageStanza *stanza,
+                                  void (*merge)(PackageStanza *existing, const PackageStanza *candidate));
+static const PackageStanza *find_package_stanza(const PackageIndex *index, const gchar *name, gsize name_length);
+static guint32 hash_package_name(const gchar *name, gsize length);
+static gint compare_package_versions(const gchar *a, gsize a_length, const gchar *b, gsize b_length);
+static gint compare_version_part(const gchar *a, const gchar *a_end, const gchar *b, const gchar *b_end);
+static gint version_char_order(const gchar *c, const gchar *end);
+static void load_apt_lists_index(AptListsIndex *index);
+static void clear_apt_lists_index(AptListsIndex *index);
+static gboolean apt_package_wanted(const gchar *name, gsize length);
+static void merge_apt_stanza(PackageStanza *existing, const PackageStanza *candidate);
+static void resolve_package_selection(AppData *data, PackageSelection *selection);
+static gint select_driver_branch(const PackageIndex *packages, const GArray *gpus, gboolean *precompiled);
+static gboolean driver_branch_supports(const PackageIndex *packages, gint branch, const GArray *gpus);
+static gboolean driver_modules_match(const PackageIndex *packages, gint branch);
+static gboolean depends_relations_hold(const PackageStanza *stanza, const gchar *name, const gchar *version,
+                                       gboolean *related);
+static gboolean version_relation_holds(const gchar *version, const gchar *relation, const gchar *bound);
+static gchar *select_cuda_toolkit(const PackageIndex *packages, const gchar *driver_version);
+static gboolean cuda_runs_on_driver(const PackageIndex *packages, gint major, gint minor, const gchar *driver_version);
+static gint cuda_minimum_driver(gint major, gint minor);
+static gchar *format_package_selection(const PackageSelection *selection);
+static void clear_package_selection(PackageSelection *selection);
+static gboolean cuda_environment_configured(const gchar *path);
+static void scan_apt_sources(AptSources *sources);
+static void add_apt_source(AptSources *sources, const gchar *path);
+static void clear_apt_sources(AptSources *sources);
+static gboolean package_lists_fresh(const gchar *arg);
+static gchar *apt_update_command(const AptSources *sources);
+static void record_apt_update(const AptSources *sources, gboolean all_sources);
+static gchar *apt_sources_state_path(void);
+static gboolean detect_distro(SystemInfo *info);
+static GHashTable *parse_os_release(const gchar *contents);
+static gchar *build_nvidia_repo_id(const SystemInfo *info);
 static gboolean detect_nvidia_gpu(SystemInfo *info);
+static GArray *scan_nvidia_pci_devices(void);
+static gchar *lookup_pci_device_name(guint16 vendor_id, guint16 device_id);
+static gboolean read_sysfs_attr(const gchar *dir, const gchar *attr, gchar *buffer, gsize size);
+static void clear_gpu_device(gpointer data);
 static gboolean detect_nvidia_driver(SystemInfo *info);
+static gchar *read_kernel_driver_version(void);
+static gchar *read_userspace_driver_version(void);
+static gboolean is_version_token(const gchar *token);
 static gboolean detect_cuda(SystemInfo *info);
+static GArray *scan_cuda_toolkits(void);
+static void add_cuda_toolkit(GArray *toolkits, GHashTable *seen, const gchar *path, gboolean is_default);
+static void scan_cuda_prefix_dir(GArray *toolkits, GHashTable *seen, const gchar *dir,
+                                 const gchar *name_prefix, gint depth);
+static gboolean parse_cuda_version_json(const gchar *contents, gchar **version, gchar ***components);
+static const gchar *find_cuda_component(const CudaToolkit *toolkit, const gchar *name);
+static gint compare_versions(const gchar *a, const gchar *b);
+static void clear_cuda_toolkit(gpointer data);
 static gboolean is_wsl_system(void);
-static gboolean check_system_compatibility(AppData *data);
+static const HostFacts *get_host_facts(void);
+static gboolean check_system_compatibility(AppData *data, gboolean install_driver, gboolean install_cuda);
+static gboolean check_disk_space(AppData *data, gboolean install_driver, gboolean install_cuda);
+static SecureBootState read_secure_boot_state(const gchar *efi_dir);
+static gint read_efi_variable_byte(const gchar *efi_dir, const gchar *name);
 static gboolean check_internet_connectivity(AppData *data);
-static void update_status_display(AppData *data);
+static gboolean update_gpu_card_wrapper(gpointer data);
+static gboolean update_driver_card_wrapper(gpointer data);
+static gboolean update_cuda_card_wrapper(gpointer data);
 static void update_status_card(GtkWidget *icon_label, GtkWidget *status_label, 
                               const gchar *icon, const gchar *text, StatusType type);
 static void log_message(AppData *data, const gchar *message, StatusType type);
+static void post_log_message(AppData *data, StatusType type, const gchar *format, ...) G_GNUC_PRINTF(3, 4);
+static void post_progress(AppData *data, gdouble progress, const gchar *label);
+static void append_console_line(AppData *data, const gchar *message, StatusType type, gint64 timestamp_us);
+static void flush_console(AppData *data);
+static void console_store_append(ConsoleStore *store, const gchar *text, gsize length, StatusType type);
+static const gchar *console_store_line(const ConsoleStore *store, guint index, gsize *length, StatusType *type);
+static void console_store_clear(ConsoleStore *store);
+static guint console_trigram_bit(guchar a, guchar b, guchar c);
+static gboolean console_chunk_may_contain(const ConsoleChunk *chunk, const gchar *query);
+static gboolean console_find_folded(const gchar *text, gsize length, const gchar *query, gsize query_length);
+static gboolean console_line_matches(const ConsoleFilter *filter, const ConsoleChunk *chunk, guint line);
+static guint console_filter_sync(AppData *data);
+static void console_filter_rebuild(AppData *data);
+static void on_console_filter_changed(GtkWidget *widget, AppData *data);
+static gboolean on_console_draw(GtkWidget *widget, cairo_t *cr, AppData *data);
+static void on_console_size_allocate(GtkWidget *widget, GdkRectangle *allocation, AppData *data);
+static void on_console_style_updated(GtkWidget *widget, AppData *data);
+static gboolean on_console_scroll(GtkWidget *widget, GdkEventScroll *event, AppData *data);
+static void on_console_scrolled(GtkAdjustment *adjustment, AppData *data);
+static gdouble console_visible_rows(AppData *data);
+static const gchar *console_timestamp(AppData *data, gint64 timestamp_us);
+static void start_console_benchmark(AppData *data);
+static void *console_benchmark_producer(void *arg);
+static gboolean console_benchmark_tick(GtkWidget *widget, GdkFrameClock *clock, gpointer user_data);
+static void log_ring_init(LogRing *ring);
+static void post_output_line(AppData *data, StatusType type, const gchar *line);
+static Journal *journal_open(void);
+static gchar *app_state_path(const gchar *name);
+static void journal_close(Journal *journal);
+static void journal_post(Journal *journal, JournalRecordKind kind, StatusType type, const gchar *text);
+static void journal_post_output(Journal *journal, StatusType type, const gchar *line, gboolean is_stderr);
+static void journal_step_end(Journal *journal, const gchar *step, gint result);
+static void *journal_writer_thread(void *arg);
+static gboolean journal_open_file(Journal *journal, const gchar *directory);
+static void journal_format_record(Journal *journal, GString *out, const JournalRecord *record);
+static void journal_append_json_string(GString *out, const gchar *text);
+static void journal_write_batch(Journal *journal, GString *batch, gboolean sync);
+static void journal_rotate(Journal *journal);
+static gboolean journal_compress(const gchar *path, const gchar *gz_path);
+static void journal_prune(const gchar *directory);
+static void journal_relocate(Journal *journal);
+static void journal_record_free(gpointer data);
+static void prepare_journal_dir(void);
+static LogEvent *log_ring_claim(LogRing *ring, guint *position);
+static void log_ring_publish(LogEvent *event, guint position);
+static gboolean drain_log_ring(gpointer user_data);
+static guint log_ring_pending(LogRing *ring);
 static gint run_command(const gchar *command, gchar **output);
-static gboolean run_command_with_progress(const gchar *command, AppData *data, gdouble progress_increment);
+static gint execute_command(const CommandRequest *request);
+static gint open_pidfd(pid_t pid);
+static void init_cancel_token(CancelToken *token);
+static void cancel_token_trigger(CancelToken *token);
+static void cancel_token_reset(CancelToken *token);
+static gboolean cancel_token_is_cancelled(const CancelToken *token);
+static void clear_cancel_token(CancelToken *token);
+static gchar **build_command_argv(const gchar *command);
+static StatusType classify_output_line(const gchar *line);
+static void console_stream_line(gpointer user_data, const gchar *line, gboolean is_stderr);
+static gboolean run_command_with_progress(const gchar *command, AppData *data, gint timeout_seconds,
+                                          gboolean as_root, const CommandSink *status);
 static void show_error_dialog(GtkWidget *parent, const gchar *title, const gchar *message);
 static gboolean show_confirmation_dialog(GtkWidget *parent, const gchar *title, const gchar *message);
 static gchar *get_sudo_password(GtkWidget *parent);
-static gboolean verify_sudo_access(const gchar *password);
+static PrivilegedHelper *start_privileged_helper(const gchar *password);
+static void stop_privileged_helper(PrivilegedHelper *helper);
+static gboolean privileged_helper_alive(PrivilegedHelper *helper);
+static gint execute_privileged(PrivilegedHelper *helper, const CommandRequest *request);
+static void *privileged_launcher_thread(void *arg);
+static void *privileged_reader_thread(void *arg);
+static gint run_privileged_helper(const gchar *socket_name);
+static void *helper_job_thread(void *arg);
+static void helper_job_line(gpointer user_data, const gchar *line, gboolean is_stderr);
+static void helper_job_status_line(gpointer user_data, const gchar *line, gboolean is_stderr);
+static gboolean helper_write_frame(gint fd, HelperFrameType type, guint32 request_id,
+                                   const void *payload, gsize length);
+static gboolean helper_read_frame(gint fd, HelperFrameHeader *header, GString *payload);
+static gboolean read_exact(gint fd, void *buffer, gsize length);
+static socklen_t helper_socket_address(const gchar *name, struct sockaddr_un *address);
 static void cleanup_app_data(AppData *data);
-static gboolean update_progress_ui(gpointer user_data);
-static gboolean update_log_ui(gpointer user_data);
-static gboolean update_status_display_wrapper(gpointer data);
 static gboolean show_completion_dialog_wrapper(gpointer data);
 static gboolean show_error_dialog_wrapper(gpointer data);
+static gboolean show_auth_error_dialog_wrapper(gpointer data);
 
 // CSS styling for modern appearance
 static const gchar *css_style = 
@@ -176,6 +928,18 @@ static const gchar *css_style =
 "    font-family: monospace;\n"
 "}\n";
 
+// Choices of the console severity filter
+static const struct {
+    const gchar *label;
+    gint severity;
+} console_severity_filters[] = {
+    { "All messages", -1 },
+    { "Errors", STATUS_ERROR },
+    { "Warnings", STATUS_WARNING },
+    { "Success", STATUS_SUCCESS },
+    { "Info", STATUS_INFO },
+};
+
 // Main application entry point
 int main(int argc, char *argv[]) {
     #ifndef __linux__
@@ -183,7 +947,16 @@ int main(int argc, char *argv[]) {
     return 1;
     #endif
     
+    // Re-executed through sudo by start_privileged_helper, never shows a window
+    if (argc == 3 && strcmp(argv[1], PRIVILEGED_HELPER_FLAG) == 0) {
+        return run_privileged_helper(argv[2]);
+    }
+    
     gtk_init(&argc, &argv);
+    gboolean benchmark_console = (argc == 2 && strcmp(argv[1], CONSOLE_BENCHMARK_FLAG) == 0);
+    
+    // Writes to a child that already exited must fail with EPIPE, not kill the app
+    signal(SIGPIPE, SIG_IGN);
     
     app_data = g_malloc0(sizeof(AppData));
     init_app_data(app_data);
@@ -194,7 +967,15 @@ int main(int argc, char *argv[]) {
     gtk_widget_show_all(app_data->main_window);
     gtk_widget_hide(app_data->progress_frame);
     
-    pthread_create(&app_data->worker_thread, NULL, detection_thread, app_data);
+    g_timeout_add(LOG_DRAIN_INTERVAL_MS, drain_log_ring, app_data);
+    if (!benchmark_console) {
+        app_data->journal = journal_open();
+    }
+    if (benchmark_console) {
+        start_console_benchmark(app_data);
+    } else {
+        pthread_create(&app_data->worker_thread, NULL, detection_thread, app_data);
+    }
     
     gtk_main();
     
@@ -207,13 +988,45 @@ int main(int argc, char *argv[]) {
 // Initialize application data structure
 static void init_app_data(AppData *data) {
     data->installation_running = FALSE;
+    data->preview_transaction = FALSE;
+    init_cancel_token(&data->cancel);
+    log_ring_init(&data->log_ring);
+    data->journal = NULL;
+    data->console_store.chunks = g_ptr_array_new();
+    data->console_store.first_line = 0;
+    data->console_store.line_count = 0;
+    for (gint i = 0; i < STATUS_TYPE_COUNT; i++) {
+        data->console_store.severity_lines[i] = g_array_new(FALSE, FALSE, sizeof(guint64));
+    }
+    data->console_filter.severity = -1;
+    data->console_filter.query = NULL;
+    data->console_filter.regex = NULL;
+    data->console_filter.invalid = FALSE;
+    data->console_filter.rows = NULL;
+    data->console_filter.scanned_until = 0;
+    data->console_synced_first_line = 0;
+    data->console_layout = NULL;
+    data->console_row_height = 1;
+    data->console_lines_total = 0;
+    data->console_stamp_second = -1;
+    data->helper = NULL;
     data->system_info.gpu_detected = FALSE;
     data->system_info.driver_installed = FALSE;
     data->system_info.cuda_installed = FALSE;
     data->system_info.gpu_info = g_strdup("Unknown");
     data->system_info.driver_info = g_strdup("Unknown");
+    data->system_info.driver_kernel_version = NULL;
+    data->system_info.driver_userspace_version = NULL;
+    data->system_info.driver_version_mismatch = FALSE;
     data->system_info.cuda_info = g_strdup("Unknown");
+    data->system_info.gpus = NULL;
+    data->system_info.cuda_toolkits = NULL;
+    data->system_info.os_id = NULL;
+    data->system_info.os_version_id = NULL;
+    data->system_info.os_id_like = NULL;
     data->system_info.distro_codename = NULL;
+    data->system_info.upstream_codename = NULL;
+    data->system_info.nvidia_repo_id = NULL;
 }
 
 // Create main application window
@@ -347,6 +1160,9 @@ static void create_options_section(GtkWidget *container, AppData *data) {
     GtkWidget *cuda_desc = gtk_label_new("    • Installs CUDA for GPU computing and sets up environment variables");
     gtk_widget_set_halign(cuda_desc, GTK_ALIGN_START);
     gtk_box_pack_start(GTK_BOX(options_box), cuda_desc, FALSE, FALSE, 0);
+    
+    data->preview_packages_check = gtk_check_button_new_with_label("Preview package changes before installing");
+    gtk_box_pack_start(GTK_BOX(options_box), data->preview_packages_check, FALSE, FALSE, 0);
 }
 
 // Create progress section for installation tracking
@@ -367,19 +1183,45 @@ static void create_progress_section(GtkWidget *container, AppData *data) {
     gtk_widget_set_halign(data->progress_label, GTK_ALIGN_START);
     gtk_box_pack_start(GTK_BOX(progress_box), data->progress_label, FALSE, FALSE, 0);
     
-    GtkWidget *console_scroll = gtk_scrolled_window_new(NULL, NULL);
-    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(console_scroll), 
-                                   GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
-    gtk_widget_set_size_request(console_scroll, -1, 200);
-    gtk_box_pack_start(GTK_BOX(progress_box), console_scroll, TRUE, TRUE, 0);
+    GtkWidget *filter_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 10);
+    gtk_box_pack_start(GTK_BOX(progress_box), filter_box, FALSE, FALSE, 0);
     
-    data->console_textview = gtk_text_view_new();
-    data->console_buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(data->console_textview));
-    gtk_text_buffer_set_text(data->console_buffer, "", -1); // Initialize empty
-    gtk_text_view_set_editable(GTK_TEXT_VIEW(data->console_textview), FALSE);
-    gtk_text_view_set_cursor_visible(GTK_TEXT_VIEW(data->console_textview), FALSE);
-    gtk_style_context_add_class(gtk_widget_get_style_context(data->console_textview), "console-view");
-    gtk_container_add(GTK_CONTAINER(console_scroll), data->console_textview);
+    data->console_severity_combo = gtk_combo_box_text_new();
+    for (guint i = 0; i < G_N_ELEMENTS(console_severity_filters); i++) {
+        gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(data->console_severity_combo), console_severity_filters[i].label);
+    }
+    gtk_combo_box_set_active(GTK_COMBO_BOX(data->console_severity_combo), 0);
+    g_signal_connect(data->console_severity_combo, "changed", G_CALLBACK(on_console_filter_changed), data);
+    gtk_box_pack_start(GTK_BOX(filter_box), data->console_severity_combo, FALSE, FALSE, 0);
+    
+    // search-changed is already debounced by GtkSearchEntry
+    data->console_search_entry = gtk_search_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(data->console_search_entry), "Search log");
+    g_signal_connect(data->console_search_entry, "search-changed", G_CALLBACK(on_console_filter_changed), data);
+    gtk_box_pack_start(GTK_BOX(filter_box), data->console_search_entry, TRUE, TRUE, 0);
+    
+    data->console_regex_check = gtk_check_button_new_with_label("Regex");
+    g_signal_connect(data->console_regex_check, "toggled", G_CALLBACK(on_console_filter_changed), data);
+    gtk_box_pack_start(GTK_BOX(filter_box), data->console_regex_check, FALSE, FALSE, 0);
+    
+    GtkWidget *console_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
+    gtk_widget_set_size_request(console_box, -1, 200);
+    gtk_box_pack_start(GTK_BOX(progress_box), console_box, TRUE, TRUE, 0);
+    
+    data->console_adjustment = gtk_adjustment_new(0.0, 0.0, 0.0, 1.0, 1.0, 1.0);
+    g_signal_connect(data->console_adjustment, "value-changed", G_CALLBACK(on_console_scrolled), data);
+    
+    data->console_view = gtk_drawing_area_new();
+    gtk_widget_add_events(data->console_view, GDK_SCROLL_MASK | GDK_SMOOTH_SCROLL_MASK);
+    gtk_style_context_add_class(gtk_widget_get_style_context(data->console_view), "console-view");
+    g_signal_connect(data->console_view, "draw", G_CALLBACK(on_console_draw), data);
+    g_signal_connect(data->console_view, "size-allocate", G_CALLBACK(on_console_size_allocate), data);
+    g_signal_connect(data->console_view, "style-updated", G_CALLBACK(on_console_style_updated), data);
+    g_signal_connect(data->console_view, "scroll-event", G_CALLBACK(on_console_scroll), data);
+    gtk_box_pack_start(GTK_BOX(console_box), data->console_view, TRUE, TRUE, 0);
+    
+    GtkWidget *console_scrollbar = gtk_scrollbar_new(GTK_ORIENTATION_VERTICAL, data->console_adjustment);
+    gtk_box_pack_start(GTK_BOX(console_box), console_scrollbar, FALSE, FALSE, 0);
 }
 
 // Create buttons section
@@ -398,6 +1240,12 @@ static void create_buttons_section(GtkWidget *container, AppData *data) {
     g_signal_connect(data->install_button, "clicked", G_CALLBACK(on_install_clicked), data);
     gtk_box_pack_start(GTK_BOX(button_box), data->install_button, FALSE, FALSE, 0);
     
+    data->cancel_button = gtk_button_new_with_label("[CANCEL]");
+    gtk_widget_set_size_request(data->cancel_button, 120, 40);
+    gtk_widget_set_sensitive(data->cancel_button, FALSE);
+    g_signal_connect(data->cancel_button, "clicked", G_CALLBACK(on_cancel_clicked), data);
+    gtk_box_pack_start(GTK_BOX(button_box), data->cancel_button, FALSE, FALSE, 0);
+    
     GtkWidget *close_button = gtk_button_new_with_label("[CLOSE]");
     gtk_widget_set_size_request(close_button, 120, 40);
     g_signal_connect(close_button, "clicked", G_CALLBACK(gtk_main_quit), NULL);
@@ -485,24 +1333,22 @@ static void on_install_clicked(GtkWidget *widget __attribute__((unused)), AppDat
     
     g_string_free(message, TRUE);
     
-    gchar *password = get_sudo_password(data->main_window);
-    if (password == NULL) {
-        return;
-    }
-    
-    if (!verify_sudo_access(password)) {
-        show_error_dialog(data->main_window, "Error", 
-                         "Invalid password or insufficient privileges.");
-        g_free(password);
-        return;
+    // One authentication per session: the helper keeps running until the app exits. Starting
+    // it can take as long as sudo does, so installation_thread does that.
+    if (!privileged_helper_alive(data->helper) && geteuid() != 0) {
+        data->helper_password = get_sudo_password(data->main_window);
+        if (data->helper_password == NULL) {
+            return;
+        }
     }
     
-    g_free(password);
-    
+    cancel_token_reset(&data->cancel);
+    data->preview_transaction = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(data->preview_packages_check));
     data->installation_running = TRUE;
     gtk_widget_show(data->progress_frame);
     gtk_widget_set_sensitive(data->install_button, FALSE);
     gtk_widget_set_sensitive(data->detect_button, FALSE);
+    gtk_widget_set_sensitive(data->cancel_button, TRUE);
     gtk_button_set_label(GTK_BUTTON(data->install_button), "Installing...");
     
     log_message(data, "Starting installation process...", STATUS_INFO);
@@ -510,48 +1356,129 @@ static void on_install_clicked(GtkWidget *widget __attribute__((unused)), AppDat
     pthread_create(&data->worker_thread, NULL, installation_thread, data);
 }
 
-// Detection thread function
-static void *detection_thread(void *arg) {
-    AppData *data = (AppData *)arg;
-    
-    log_message(data, "Detecting system components...", STATUS_INFO);
-    
-    // Detect distro
-    log_message(data, "Detecting Linux distribution...", STATUS_INFO);
-    run_command("lsb_release -cs 2>/dev/null", &data->system_info.distro_codename);
-    if (data->system_info.distro_codename) {
-        g_strchomp(data->system_info.distro_codename);
-        log_message(data, g_strdup_printf("Distribution codename: %s", data->system_info.distro_codename), STATUS_INFO);
-    } else {
-        data->system_info.distro_codename = g_strdup("unknown");
-        log_message(data, "Unable to detect distribution codename", STATUS_WARNING);
+// Handle cancel button click
+static void on_cancel_clicked(GtkWidget *widget __attribute__((unused)), AppData *data) {
+    if (!data->installation_running || cancel_token_is_cancelled(&data->cancel)) {
+        return;
     }
     
-    struct timespec delay = {0, DETECTION_DELAY_NS};
-    nanosleep(&delay, NULL);
-    
-    log_message(data, "Checking for NVIDIA GPU...", STATUS_INFO);
-    detect_nvidia_gpu(&data->system_info);
+    gtk_widget_set_sensitive(data->cancel_button, FALSE);
+    log_message(data, "Cancelling installation, stopping the running command...", STATUS_WARNING);
+    cancel_token_trigger(&data->cancel);
+}
+
+// Detection probes: each one fills its own SystemInfo fields and refreshes its own card
+static const ProbeSpec probe_specs[PROBE_COUNT] = {
+    [PROBE_DISTRO] = { "distribution", "Detecting Linux distribution...", detect_distro, NULL },
+    [PROBE_GPU]    = { "GPU", "Checking for NVIDIA GPU...", detect_nvidia_gpu, update_gpu_card_wrapper },
+    [PROBE_DRIVER] = { "driver", "Checking driver status...", detect_nvidia_driver, update_driver_card_wrapper },
+    [PROBE_CUDA]   = { "CUDA", "Checking CUDA status...", detect_cuda, update_cuda_card_wrapper },
+};
+
+// Run a single detection probe and report back as soon as it finishes
+static void *probe_thread(void *arg) {
+    ProbeTask *task = (ProbeTask *)arg;
+    gint64 started = g_get_monotonic_time();
     
-    nanosleep(&delay, NULL);
+    task->result = task->spec->detect(&task->app_data->system_info);
+    task->elapsed_us = g_get_monotonic_time() - started;
     
-    log_message(data, "Checking driver status...", STATUS_INFO);
-    detect_nvidia_driver(&data->system_info);
+    if (task->spec->update_card) {
+        g_idle_add(task->spec->update_card, task->app_data);
+    }
     
-    nanosleep(&delay, NULL);
+    g_async_queue_push(task->done_queue, task);
+    return NULL;
+}
+
+// Detection thread function: starts every probe at once and collects them as they finish
+static void *detection_thread(void *arg) {
+    AppData *data = (AppData *)arg;
+    ProbeTask tasks[PROBE_COUNT];
+    gboolean started[PROBE_COUNT];
+    gint running = 0;
+    gint64 detection_start = g_get_monotonic_time();
+    GAsyncQueue *done_queue = g_async_queue_new();
+    
+    const HostFacts *host = get_host_facts();
+    post_log_message(data, STATUS_INFO, "Detecting system components...");
+    post_log_message(data, STATUS_INFO, "Host: kernel %s, %s%s", host->kernel_release,
+                     host->uts.machine, host->is_wsl ? ", WSL" : "");
+    
+    for (gint i = 0; i < PROBE_COUNT; i++) {
+        tasks[i].app_data = data;
+        tasks[i].spec = &probe_specs[i];
+        tasks[i].result = FALSE;
+        tasks[i].elapsed_us = 0;
+        tasks[i].done_queue = done_queue;
+        
+        post_log_message(data, STATUS_INFO, "%s", probe_specs[i].start_message);
+        started[i] = (pthread_create(&tasks[i].thread, NULL, probe_thread, &tasks[i]) == 0);
+        if (started[i]) {
+            running++;
+        } else {
+            // Could not get a thread, run this probe inline instead of skipping it
+            probe_thread(&tasks[i]);
+            g_async_queue_pop(done_queue);
+            post_log_message(data, STATUS_INFO, "%s probe finished in %.0f ms",
+                             probe_specs[i].name, tasks[i].elapsed_us / 1000.0);
+        }
+    }
     
-    log_message(data, "Checking CUDA status...", STATUS_INFO);
-    detect_cuda(&data->system_info);
+    while (running > 0) {
+        ProbeTask *task = g_async_queue_pop(done_queue);
+        running--;
+        post_log_message(data, STATUS_INFO, "%s probe finished in %.0f ms",
+                         task->spec->name, task->elapsed_us / 1000.0);
+        
+        if (task->spec == &probe_specs[PROBE_GPU] && data->system_info.gpus) {
+            for (guint i = 0; i < data->system_info.gpus->len; i++) {
+                GpuDevice *gpu = &g_array_index(data->system_info.gpus, GpuDevice, i);
+                post_log_message(data, STATUS_INFO,
+                                 "GPU %s: %s [10de:%04x] subsystem %04x:%04x, NUMA node %d, IOMMU group %d",
+                                 gpu->bdf, gpu->model_name, gpu->device_id,
+                                 gpu->subsys_vendor_id, gpu->subsys_device_id,
+                                 gpu->numa_node, gpu->iommu_group);
+            }
+        } else if (task->spec == &probe_specs[PROBE_DRIVER] && data->system_info.driver_version_mismatch) {
+            post_log_message(data, STATUS_WARNING,
+                             "Loaded kernel module (%s) does not match installed userspace driver (%s)",
+                             data->system_info.driver_kernel_version ? data->system_info.driver_kernel_version : "not loaded",
+                             data->system_info.driver_userspace_version);
+        } else if (task->spec == &probe_specs[PROBE_CUDA] && data->system_info.cuda_toolkits) {
+            for (guint i = 0; i < data->system_info.cuda_toolkits->len; i++) {
+                CudaToolkit *toolkit = &g_array_index(data->system_info.cuda_toolkits, CudaToolkit, i);
+                const gchar *nvcc = find_cuda_component(toolkit, "cuda_nvcc");
+                const gchar *cudart = find_cuda_component(toolkit, "cuda_cudart");
+                
+                post_log_message(data, STATUS_INFO, "CUDA %s at %s%s (nvcc %s, cudart %s, %u components)",
+                                 toolkit->version, toolkit->path,
+                                 toolkit->is_default ? " [default]" : "",
+                                 nvcc ? nvcc : "n/a", cudart ? cudart : "n/a",
+                                 toolkit->components ? g_strv_length(toolkit->components) : 0);
+            }
+        } else if (task->spec == &probe_specs[PROBE_DISTRO]) {
+            if (task->result) {
+                post_log_message(data, STATUS_INFO, "Distribution: %s %s (%s), NVIDIA repository: %s",
+                                 data->system_info.os_id,
+                                 data->system_info.os_version_id ? data->system_info.os_version_id : "",
+                                 data->system_info.distro_codename,
+                                 data->system_info.nvidia_repo_id ? data->system_info.nvidia_repo_id : "unsupported");
+            } else {
+                post_log_message(data, STATUS_WARNING, "Unable to read %s", OS_RELEASE_PATH);
+            }
+        }
+    }
     
-    ProgressUpdate *update = g_malloc(sizeof(ProgressUpdate));
-    update->app_data = data;
-    update->progress = 0.0;
-    update->message = NULL;
-    update->log_message = g_strdup("System detection completed.");
-    update->log_type = STATUS_INFO;
-    g_idle_add(update_progress_ui, update);
+    for (gint i = 0; i < PROBE_COUNT; i++) {
+        if (started[i]) {
+            pthread_join(tasks[i].thread, NULL);
+        }
+    }
+    g_async_queue_unref(done_queue);
     
-    g_idle_add(update_status_display_wrapper, data);
+    post_log_message(data, STATUS_INFO, "System detection completed in %.0f ms.",
+                     (g_get_monotonic_time() - detection_start) / 1000.0);
     
     g_idle_add(set_widget_sensitive_wrapper, data->detect_button);
     
@@ -566,12 +1493,37 @@ static void *installation_thread(void *arg) {
     gboolean install_cuda = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(data->install_cuda_check));
     
     gboolean success = TRUE;
-    gdouble progress = 0.0;
-    gint total_steps = 1 + (install_driver ? 4 : 0) + (install_cuda ? 4 : 0); // Update, prereqs, + steps per option
-    gdouble progress_increment = 100.0 / total_steps;
     
-    if (!check_system_compatibility(data)) {
+    if (!privileged_helper_alive(data->helper)) {
+        stop_privileged_helper(data->helper);
+        post_log_message(data, STATUS_INFO, "Starting the privileged helper...");
+        data->helper = start_privileged_helper(data->helper_password);
+        if (data->helper_password) {
+            memset(data->helper_password, 0, strlen(data->helper_password));
+            g_free(data->helper_password);
+            data->helper_password = NULL;
+        }
+        
+        if (!data->helper) {
+            post_log_message(data, STATUS_ERROR, "Invalid password or insufficient privileges");
+            data->installation_running = FALSE;
+            g_idle_add(set_widget_insensitive_wrapper, data->cancel_button);
+            g_idle_add(set_widget_sensitive_wrapper, data->install_button);
+            g_idle_add(set_widget_sensitive_wrapper, data->detect_button);
+            g_idle_add(set_button_label_wrapper, data->install_button);
+            g_idle_add(show_auth_error_dialog_wrapper, data);
+            return NULL;
+        }
+        // The helper created JOURNAL_DIR for us
+        journal_relocate(data->journal);
+    }
+    
+    journal_post(data->journal, JOURNAL_RECORD_STEP_BEGIN, STATUS_INFO, "install");
+    
+    if (!check_system_compatibility(data, install_driver, install_cuda)) {
+        journal_step_end(data->journal, "install", 1);
         data->installation_running = FALSE;
+        g_idle_add(set_widget_insensitive_wrapper, data->cancel_button);
         g_idle_add(set_widget_sensitive_wrapper, data->install_button);
         g_idle_add(set_widget_sensitive_wrapper, data->detect_button);
         g_idle_add(set_button_label_wrapper, data->install_button);
@@ -579,347 +1531,2620 @@ static void *installation_thread(void *arg) {
     }
     
     if (!check_internet_connectivity(data)) {
+        journal_step_end(data->journal, "install", cancel_token_is_cancelled(&data->cancel) ? COMMAND_CANCELLED : 1);
         data->installation_running = FALSE;
+        g_idle_add(set_widget_insensitive_wrapper, data->cancel_button);
         g_idle_add(set_widget_sensitive_wrapper, data->install_button);
         g_idle_add(set_widget_sensitive_wrapper, data->detect_button);
         g_idle_add(set_button_label_wrapper, data->install_button);
-        g_idle_add(show_error_dialog_wrapper, data);
+        if (!cancel_token_is_cancelled(&data->cancel)) {
+            g_idle_add(show_error_dialog_wrapper, data);
+        }
         return NULL;
     }
     
-    // Update package lists
-    progress += progress_increment;
-    ProgressUpdate *update = g_malloc(sizeof(ProgressUpdate));
-    update->app_data = data;
-    update->progress = progress;
-    update->message = g_strdup("Updating package lists...");
-    update->log_message = g_strdup("Updating package repositories...");
-    update->log_type = STATUS_INFO;
-    g_idle_add(update_progress_ui, update);
-    
-    if (!run_command_with_progress("sudo apt-get update", data, progress_increment)) {
+    if ((install_driver || install_cuda) && (!data->system_info.nvidia_repo_id || !get_host_facts()->cuda_repo_arch)) {
+        post_log_message(data, STATUS_ERROR, "No NVIDIA CUDA repository is published for %s %s on %s",
+                         data->system_info.os_id ? data->system_info.os_id : "this distribution",
+                         data->system_info.os_version_id ? data->system_info.os_version_id : "",
+                         get_host_facts()->uts.machine);
         success = FALSE;
         goto cleanup_install;
     }
     
-    // Install prerequisites
-    progress += progress_increment;
-    update = g_malloc(sizeof(ProgressUpdate));
-    update->app_data = data;
-    update->progress = progress;
-    update->message = g_strdup("Installing prerequisites...");
-    update->log_message = g_strdup("Installing required packages...");
-    update->log_type = STATUS_INFO;
-    g_idle_add(update_progress_ui, update);
-    
-    const gchar *prereq_cmd = "sudo apt-get install -y software-properties-common "
-                             "apt-transport-https ca-certificates curl wget gnupg "
-                             "lsb-release build-essential dkms";
-    
-    if (!run_command_with_progress(prereq_cmd, data, progress_increment)) {
+    // Downloads go to a directory of the tool's own, not wherever it was started from, and stay
+    // there for a resumed install until the plan finishes
+    gchar *download_dir = app_state_path(INSTALL_DOWNLOAD_DIR);
+    if (g_mkdir_with_parents(download_dir, 0700) != 0) {
+        post_log_message(data, STATUS_ERROR, "Cannot create %s: %s", download_dir, g_strerror(errno));
+        g_free(download_dir);
         success = FALSE;
         goto cleanup_install;
     }
     
-    if (install_driver) {
-        // Add NVIDIA repository
-        progress += progress_increment;
-        update = g_malloc(sizeof(ProgressUpdate));
-        update->app_data = data;
-        update->progress = progress;
-        update->message = g_strdup("Adding NVIDIA repository...");
-        update->log_message = g_strdup("Adding NVIDIA repository...");
-        update->log_type = STATUS_INFO;
-        g_idle_add(update_progress_ui, update);
-        
-        gchar *repo_cmd = g_strdup_printf(
-            "wget https://developer.download.nvidia.com/compute/cuda/repos/%s/x86_64/cuda-keyring_1.1-1_all.deb",
-            data->system_info.distro_codename);
-        if (!run_command_with_progress(repo_cmd, data, progress_increment)) {
-            success = FALSE;
-            g_free(repo_cmd);
-            goto cleanup_install;
-        }
-        g_free(repo_cmd);
-        
-        if (!run_command_with_progress("sudo dpkg -i cuda-keyring_1.1-1_all.deb", data, progress_increment)) {
-            success = FALSE;
-            goto cleanup_install;
-        }
-        
-        // Update package lists after adding repository
-        progress += progress_increment;
-        update = g_malloc(sizeof(ProgressUpdate));
-        update->app_data = data;
-        update->progress = progress;
-        update->message = g_strdup("Updating package lists...");
-        update->log_message = g_strdup("Updating package lists with NVIDIA repository...");
-        update->log_type = STATUS_INFO;
-        g_idle_add(update_progress_ui, update);
-        
-        if (!run_command_with_progress("sudo apt-get update", data, progress_increment)) {
-            success = FALSE;
-            goto cleanup_install;
-        }
-        
-        // Install NVIDIA driver
-        progress += progress_increment;
-        update = g_malloc(sizeof(ProgressUpdate));
-        update->app_data = data;
-        update->progress = progress;
-        update->message = g_strdup("Installing NVIDIA driver...");
-        update->log_message = g_strdup("Installing NVIDIA proprietary driver...");
-        update->log_type = STATUS_INFO;
-        g_idle_add(update_progress_ui, update);
-        
-        if (!run_command_with_progress("sudo apt-get install -y cuda-drivers", data, progress_increment)) {
-            success = FALSE;
-            goto cleanup_install;
-        }
+    PackageSelection selection = { install_driver, install_cuda, NULL, NULL, NULL, NULL, FALSE };
+    GKeyFile *checkpoint = load_install_checkpoint(data, &selection);
+    if (selection.pinned) {
+        post_log_message(data, STATUS_INFO, "Resuming with the packages the interrupted install resolved");
+    } else {
+        resolve_package_selection(data, &selection);
     }
+    GArray *plan = build_install_plan(data, &selection, download_dir);
+    const InstallStep *failed_step = run_install_plan(data, plan, checkpoint);
     
-    if (install_cuda) {
-        // Add CUDA repository (already added with driver, but ensure keyring)
-        progress += progress_increment;
-        update = g_malloc(sizeof(ProgressUpdate));
-        update->app_data = data;
-        update->progress = progress;
-        update->message = g_strdup("Verifying CUDA repository...");
-        update->log_message = g_strdup("Ensuring NVIDIA CUDA repository...");
-        update->log_type = STATUS_INFO;
-        g_idle_add(update_progress_ui, update);
-        
-        if (!run_command_with_progress("sudo apt-get update", data, progress_increment)) {
-            success = FALSE;
-            goto cleanup_install;
-        }
-        
-        // Install CUDA toolkit
-        progress += progress_increment;
-        update = g_malloc(sizeof(ProgressUpdate));
-        update->app_data = data;
-        update->progress = progress;
-        update->message = g_strdup("Installing CUDA toolkit...");
-        update->log_message = g_strdup("Installing CUDA toolkit...");
-        update->log_type = STATUS_INFO;
-        g_idle_add(update_progress_ui, update);
-        
-        if (!run_command_with_progress("sudo apt-get install -y cuda-toolkit-12-6", data, progress_increment)) {
-            success = FALSE;
-            goto cleanup_install;
-        }
-        
-        // Setup environment variables
-        progress += progress_increment;
-        update = g_malloc(sizeof(ProgressUpdate));
-        update->app_data = data;
-        update->progress = progress;
-        update->message = g_strdup("Setting up environment variables...");
-        update->log_message = g_strdup("Configuring CUDA environment...");
-        update->log_type = STATUS_INFO;
-        g_idle_add(update_progress_ui, update);
-        
-        const gchar *env_cmd = "echo 'export PATH=/usr/local/cuda/bin${PATH:+:$PATH}' | sudo tee /etc/profile.d/cuda.sh && "
-                              "echo 'export LD_LIBRARY_PATH=/usr/local/cuda/lib64${LD_LIBRARY_PATH:+:$LD_LIBRARY_PATH}' | sudo tee -a /etc/profile.d/cuda.sh";
-        
-        if (!run_command_with_progress(env_cmd, data, progress_increment)) {
-            success = FALSE;
-            goto cleanup_install;
-        }
-    }
-    
-    // Final update
-    progress = 100.0;
-    update = g_malloc(sizeof(ProgressUpdate));
-    update->app_data = data;
-    update->progress = progress;
-    update->message = g_strdup("Installation completed successfully!");
-    update->log_message = g_strdup("Installation completed successfully!");
-    update->log_type = STATUS_SUCCESS;
-    g_idle_add(update_progress_ui, update);
-    
-    // Clean up downloaded files
-    run_command("rm -f cuda-keyring_1.1-1_all.deb", NULL);
-    
-cleanup_install:
-    if (!success) {
-        run_command("sudo apt-get autoremove -y", NULL); // Clean up partial installs
+    gchar *checkpoint_path = install_checkpoint_path();
+    if (failed_step) {
+        success = FALSE;
+        post_log_message(data, STATUS_INFO, "Installing again skips the finished steps and resumes at: %s",
+                         failed_step->label);
+    } else {
+        // A finished plan starts from scratch next time, downloads included, removed by the
+        // paths the steps wrote them to
+        unlink(checkpoint_path);
+        for (guint i = 0; i < plan->len; i++) {
+            const gchar *artifact = g_array_index(plan, InstallStep, i).artifact;
+            if (artifact) unlink(artifact);
+        }
+        rmdir(download_dir);
+        post_progress(data, 100.0, "Installation completed successfully!");
+        post_log_message(data, STATUS_SUCCESS, "Installation completed successfully!");
     }
+    g_free(checkpoint_path);
+    g_key_file_free(checkpoint);
+    
+    g_free(download_dir);
+    g_array_unref(plan);
+    clear_package_selection(&selection);
+    
+cleanup_install:;
+    // A stopped install leaves everything in place for the next run to resume from
+    gboolean cancelled = !success && cancel_token_is_cancelled(&data->cancel);
+    if (cancelled) {
+        post_log_message(data, STATUS_WARNING, "Installation cancelled, remaining steps skipped");
+    }
+    journal_step_end(data->journal, "install", success ? 0 : (cancelled ? COMMAND_CANCELLED : 1));
     
     data->installation_running = FALSE;
     
+    g_idle_add(set_widget_insensitive_wrapper, data->cancel_button);
     g_idle_add(set_widget_sensitive_wrapper, data->install_button);
     g_idle_add(set_widget_sensitive_wrapper, data->detect_button);
     g_idle_add(set_button_label_wrapper, data->install_button);
     
     if (success) {
         g_idle_add(show_completion_dialog_wrapper, data);
-    } else {
+    } else if (!cancelled) {
         g_idle_add(show_error_dialog_wrapper, data);
     }
     
     return NULL;
 }
 
-// Detect NVIDIA GPU using lspci
-static gboolean detect_nvidia_gpu(SystemInfo *info) {
-    gchar *output = NULL;
-    gint result = run_command("lspci | grep -i nvidia", &output);
+// The install as a dependency graph. Steps are listed in a valid order, which is also the
+// order ready steps start in when they compete for a resource. Files are downloaded into
+// download_dir, an absolute path.
+static GArray *build_install_plan(AppData *data, PackageSelection *selection, const gchar *download_dir) {
+    gboolean install_driver = selection->install_driver;
+    gboolean install_cuda = selection->install_cuda;
+    GArray *plan = g_array_new(FALSE, TRUE, sizeof(InstallStep));
+    g_array_set_clear_func(plan, clear_install_step);
+    
+    const guint apt = INSTALL_USES(INSTALL_RESOURCE_DPKG) | INSTALL_USES(INSTALL_RESOURCE_NETWORK);
+    
+    gchar *packages = format_package_selection(selection);
+    post_log_message(data, STATUS_INFO, "Selected packages: %s", packages);
+    
+    // On a node that already has every package there is nothing to fetch, the remaining
+    // steps verify themselves as done
+    gboolean provisioned = packages_installed(packages) &&
+                           (!(install_driver || install_cuda) || packages_installed("cuda-keyring"));
+    if (provisioned) {
+        post_log_message(data, STATUS_SUCCESS, "All selected packages are already installed");
+    } else {
+        add_apt_update_step(plan, "update", "Updating package repositories...", NULL);
+    }
     
-    if (result == 0 && output != NULL && strlen(output) > 0) {
-        info->gpu_detected = TRUE;
-        g_strchug(output);
-        g_strchomp(output);
-        info->gpu_info = g_strdup_printf("Detected: %s", output);
-        g_free(output);
-        return TRUE;
+    if ((install_driver || install_cuda) && !provisioned) {
+        // Only what the keyring download needs comes ahead of the main transaction
+        gboolean bootstrap = !packages_installed(BOOTSTRAP_PACKAGES);
+        if (bootstrap) {
+            add_install_step(plan, "bootstrap", "Installing download tools...", "Installing wget and CA certificates...",
+                             g_strdup("apt-get install -y " BOOTSTRAP_PACKAGES), TIMEOUT_APT_INSTALL_S, TRUE,
+                             packages_installed, BOOTSTRAP_PACKAGES, apt, "update");
+        }
+        // The resolve step may replace the selection's keyring name later, the plan keeps its own
+        gchar *keyring = g_build_filename(download_dir, selection->keyring_deb, NULL);
+        gchar *url = g_strdup_printf("https://developer.download.nvidia.com/compute/cuda/repos/%s/%s/%s",
+                                     data->system_info.nvidia_repo_id, get_host_facts()->cuda_repo_arch,
+                                     selection->keyring_deb);
+        gchar *quoted_keyring = g_shell_quote(keyring);
+        gchar *quoted_url = g_shell_quote(url);
+        
+        add_install_step(plan, "keyring-download", "Adding NVIDIA repository...", "Downloading the NVIDIA repository keyring...",
+                         g_strdup_printf("wget -O %s %s", quoted_keyring, quoted_url),
+                         TIMEOUT_DOWNLOAD_S, FALSE, packages_installed, "cuda-keyring",
+                         INSTALL_USES(INSTALL_RESOURCE_NETWORK), bootstrap ? "bootstrap" : NULL);
+        plan_last_step(plan)->artifact = keyring;
+        plan_last_step(plan)->checkpointed = TRUE;
+        add_install_step(plan, "keyring-install", "Adding NVIDIA repository...", "Adding NVIDIA repository...",
+                         g_strdup_printf("dpkg -i %s", quoted_keyring), TIMEOUT_QUICK_S, TRUE,
+                         packages_installed, "cuda-keyring", INSTALL_USES(INSTALL_RESOURCE_DPKG), "keyring-download");
+        g_free(quoted_keyring);
+        g_free(quoted_url);
+        g_free(url);
+        add_apt_update_step(plan, "update-nvidia", "Updating package lists with NVIDIA repository...", "update keyring-install");
     }
     
-    info->gpu_detected = FALSE;
-    info->gpu_info = g_strdup("No NVIDIA GPU detected");
-    if (output) g_free(output);
-    return FALSE;
-}
-
-// Detect NVIDIA driver installation
-static gboolean detect_nvidia_driver(SystemInfo *info) {
-    gchar *output = NULL;
-    gint result = run_command("nvidia-smi --query-gpu=driver_version --format=csv,noheader,nounits 2>/dev/null", &output);
+    // Prerequisites, driver and toolkit go through one apt transaction, so dpkg triggers
+    // such as initramfs, DKMS and ldconfig run once
+    const gchar *lists = provisioned ? NULL : ((install_driver || install_cuda) ? "update-nvidia" : "update");
+    
+    // Nothing to resolve once everything the packages step would install is there
+    add_install_step(plan, "resolve", "Resolving packages...", "Resolving the package transaction...",
+                     NULL, TIMEOUT_QUICK_S, FALSE, packages_installed, packages, 0, lists);
+    plan_last_step(plan)->resolves = selection;
+    add_install_step(plan, "packages", install_driver ? "Installing NVIDIA driver and packages..." : "Installing packages...",
+                     "Installing all selected packages in one transaction...",
+                     g_strdup_printf("apt-get install -y %s", packages),
+                     install_cuda ? TIMEOUT_TOOLKIT_INSTALL_S : TIMEOUT_APT_INSTALL_S, TRUE,
+                     packages_installed, packages, apt | INSTALL_USES(INSTALL_RESOURCE_CPU), "resolve");
+    g_free(packages);
     
-    if (result == 0 && output != NULL && strlen(output) > 0) {
-        info->driver_installed = TRUE;
-        g_strchug(output);
-        g_strchomp(output);
-        info->driver_info = g_strdup_printf("Installed: Version %s", output);
-        g_free(output);
-        return TRUE;
+    if (install_cuda) {
+        // Only writes a profile script, nothing it names has to exist yet
+        add_install_step(plan, "environment", "Setting up environment variables...", "Configuring CUDA environment...",
+                         g_strdup("echo 'export PATH=/usr/local/cuda/bin${PATH:+:$PATH}' > " CUDA_ENV_FILE " && "
+                                  "echo 'export LD_LIBRARY_PATH=/usr/local/cuda/lib64${LD_LIBRARY_PATH:+:$LD_LIBRARY_PATH}' >> " CUDA_ENV_FILE),
+                         TIMEOUT_QUICK_S, TRUE, cuda_environment_configured, CUDA_ENV_FILE, 0, NULL);
     }
     
-    info->driver_installed = FALSE;
-    info->driver_info = g_strdup("Not installed");
-    if (output) g_free(output);
-    return FALSE;
+    return plan;
 }
 
-// Detect CUDA installation
-static gboolean detect_cuda(SystemInfo *info) {
-    gchar *output = NULL;
-    gint result = run_command("nvcc --version 2>/dev/null | grep 'release' | awk '{print $6}' | cut -c2-", &output);
-    
-    if (result == 0 && output != NULL && strlen(output) > 0) {
-        info->cuda_installed = TRUE;
-        g_strchug(output);
-        g_strchomp(output);
-        info->cuda_info = g_strdup_printf("Installed: CUDA %s", output);
-        g_free(output);
-        return TRUE;
+// Takes ownership of command. depends lists the ids of earlier steps, space separated.
+static void add_install_step(GArray *plan, const gchar *id, const gchar *label, const gchar *message,
+                             gchar *command, gint timeout_seconds, gboolean as_root,
+                             gboolean (*verify)(const gchar *arg), const gchar *verify_arg,
+                             guint resources, const gchar *depends) {
+    g_assert(plan->len < INSTALL_PLAN_MAX_STEPS);
+    
+    InstallStep step = {
+        .id = id,
+        .label = label,
+        .message = message,
+        .command = command,
+        .timeout_seconds = timeout_seconds,
+        .as_root = as_root,
+        .verify = verify,
+        .verify_arg = g_strdup(verify_arg),
+        .resources = resources,
+        .depends = 0,
+    };
+    
+    gchar **names = g_strsplit(depends ? depends : "", " ", -1);
+    for (gchar **name = names; *name; name++) {
+        if (!**name) continue;
+        guint i = 0;
+        while (i < plan->len && strcmp(g_array_index(plan, InstallStep, i).id, *name) != 0) i++;
+        g_assert(i < plan->len);
+        step.depends |= G_GUINT64_CONSTANT(1) << i;
     }
+    g_strfreev(names);
     
-    info->cuda_installed = FALSE;
-    info->cuda_info = g_strdup("Not installed");
-    if (output) g_free(output);
-    return FALSE;
+    g_array_append_val(plan, step);
 }
 
-// Check if running in WSL
-static gboolean is_wsl_system(void) {
-    gchar *output = NULL;
-    gint result = run_command("cat /proc/version 2>/dev/null | grep -i microsoft", &output);
-    
-    gboolean is_wsl = (result == 0 && output != NULL && strlen(output) > 0);
-    if (output) g_free(output);
-    return is_wsl;
+// apt-get update, skipped while every source is fresh
+static void add_apt_update_step(GArray *plan, const gchar *id, const gchar *message, const gchar *depends) {
+    add_install_step(plan, id, "Updating package lists...", message, g_strdup("apt-get update"),
+                     TIMEOUT_APT_UPDATE_S, TRUE, package_lists_fresh, NULL,
+                     INSTALL_USES(INSTALL_RESOURCE_DPKG) | INSTALL_USES(INSTALL_RESOURCE_NETWORK), depends);
+    plan_last_step(plan)->refreshes_lists = TRUE;
 }
 
-// Check internet connectivity
-static gboolean check_internet_connectivity(AppData *data) {
-    gint result = run_command("ping -c 1 8.8.8.8 >/dev/null 2>&1", NULL);
-    if (result != 0) {
-        log_message(data, "No internet connection detected. Installation requires internet access.", STATUS_ERROR);
-        return FALSE;
+// Simulate the transaction, report what it will do and let the user look at it first. The
+// lists were refreshed after the plan was built, so the selection is made again from them and
+// the packages step, which waits for this one, installs the result. A resumed install keeps
+// what the interrupted one resolved.
+static gboolean run_resolve_step(AppData *data, GArray *plan, const InstallStep *step) {
+    if (!step->resolves->pinned) resolve_package_selection(data, step->resolves);
+    gchar *packages = format_package_selection(step->resolves);
+    guint i = 0;
+    while (i < plan->len && strcmp(g_array_index(plan, InstallStep, i).id, "packages") != 0) i++;
+    InstallStep *install = i < plan->len ? &g_array_index(plan, InstallStep, i) : NULL;
+    
+    if (strcmp(packages, step->verify_arg) != 0) {
+        post_log_message(data, STATUS_INFO, "Selected packages: %s", packages);
+        if (install) {
+            g_free(install->command);
+            g_free(install->verify_arg);
+            install->command = g_strdup_printf("apt-get install -y %s", packages);
+            install->verify_arg = g_strdup(packages);
+        }
     }
-    return TRUE;
-}
-
-// Check system compatibility before installation
-static gboolean check_system_compatibility(AppData *data) {
-    if (is_wsl_system()) {
-        log_message(data, "ERROR: Running in WSL. NVIDIA driver installation requires native Linux.", STATUS_ERROR);
-        log_message(data, "This tool is designed for live boot Linux systems or native installations.", STATUS_INFO);
-        log_message(data, "To use this tool:", STATUS_INFO);
-        log_message(data, "1. Create a live USB with Ubuntu/Debian", STATUS_INFO);
-        log_message(data, "2. Boot from the USB on the target system", STATUS_INFO);
-        log_message(data, "3. Run this tool on the live system", STATUS_INFO);
+    
+    AptTransaction transaction = { NULL, NULL, 0 };
+    if (!resolve_apt_transaction(data, packages, &transaction)) {
+        clear_apt_transaction(&transaction);
+        g_free(packages);
         return FALSE;
     }
+    g_free(packages);
     
-    if (getuid() == 0) {
-        log_message(data, "WARNING: Running as root. This is not recommended for security reasons.", STATUS_WARNING);
+    // Sizes the download and dpkg phases of the packages step's progress
+    if (install) {
+        install->download_bytes = transaction.download_bytes;
+        install->package_count = transaction.installs->len;
     }
     
-    gchar *output = NULL;
-    gint result = run_command("df / | tail -1 | awk '{print $4}'", &output);
-    if (result == 0 && output != NULL) {
-        gint64 free_space = g_ascii_strtoll(output, NULL, 10);
-        if (free_space < 2000000) { // Less than 2GB free
-            log_message(data, "WARNING: Low disk space detected. Installation may fail.", STATUS_WARNING);
-        }
+    gchar *download = g_format_size(transaction.download_bytes);
+    post_log_message(data, STATUS_INFO, "apt will install %u packages, %s to download, and remove %u",
+                     transaction.installs->len, download, transaction.removals->len);
+    g_free(download);
+    for (guint i = 0; i < transaction.removals->len; i++) {
+        post_log_message(data, STATUS_WARNING, "Will be removed: %s", (const gchar *)g_ptr_array_index(transaction.removals, i));
     }
-    if (output) g_free(output);
     
-    // Check Secure Boot
-    result = run_command("mokutil --sb-state 2>/dev/null", &output);
-    if (result == 0 && output != NULL && strstr(output, "enabled")) {
-        log_message(data, "WARNING: Secure Boot is enabled. Driver installation may require additional steps.", STATUS_WARNING);
+    gboolean accepted = !data->preview_transaction || confirm_apt_transaction(data, &transaction);
+    if (!accepted) {
+        post_log_message(data, STATUS_WARNING, "Package changes declined");
+        // Stops the plan the same way the Cancel button does
+        cancel_token_trigger(&data->cancel);
     }
-    if (output) g_free(output);
     
-    // Check distro compatibility
-    if (data->system_info.distro_codename) {
-        if (g_strcmp0(data->system_info.distro_codename, "bullseye") == 0) {
-            log_message(data, "WARNING: Debian 11 is EOL. Upgrade recommended.", STATUS_WARNING);
-        } else if (g_strcmp0(data->system_info.distro_codename, "bookworm") != 0 &&
-                   g_strcmp0(data->system_info.distro_codename, "jammy") != 0 &&
-                   g_strcmp0(data->system_info.distro_codename, "noble") != 0) {
-            log_message(data, "WARNING: Unsupported distro. Installation may fail.", STATUS_WARNING);
+    clear_apt_transaction(&transaction);
+    return accepted;
+}
+
+// Dependency resolution without root: apt-get -s for the package actions and --print-uris
+// for the archives still to download
+static gboolean resolve_apt_transaction(AppData *data, const gchar *packages, AptTransaction *transaction) {
+    transaction->installs = g_ptr_array_new_with_free_func(g_free);
+    transaction->removals = g_ptr_array_new_with_free_func(g_free);
+    transaction->download_bytes = 0;
+    
+    gchar *commands[] = {
+        g_strdup_printf("apt-get install -s -y %s", packages),
+        g_strdup_printf("apt-get install --print-uris -qq -y %s", packages),
+    };
+    gboolean ok = TRUE;
+    
+    for (guint i = 0; i < G_N_ELEMENTS(commands) && ok; i++) {
+        gchar **argv = build_command_argv(commands[i]);
+        GString *out = g_string_new(NULL);
+        GString *err = g_string_new(NULL);
+        CommandRequest request = {
+            .argv = (const gchar *const *)argv,
+            .input = NULL,
+            .out = out,
+            .err = err,
+            .sink = NULL,
+            .timeout_ms = TIMEOUT_QUICK_S * 1000,
+            .cancel = &data->cancel,
+            .status = NULL,
+        };
+        gint status = execute_command(&request);
+        
+        if (status != 0) {
+            ok = FALSE;
+            post_log_message(data, STATUS_ERROR, "Package resolution failed: %s", commands[i]);
+            gchar **lines = g_strsplit(err->str, "\n", -1);
+            for (gchar **line = lines; *line; line++) {
+                if (**line) post_log_message(data, classify_output_line(*line), "    %s", *line);
+            }
+            g_strfreev(lines);
+        } else if (i == 0) {
+            parse_apt_simulation(out->str, transaction);
+        } else {
+            transaction->download_bytes = parse_apt_print_uris(out->str);
         }
+        
+        g_string_free(out, TRUE);
+        g_string_free(err, TRUE);
+        g_strfreev(argv);
     }
     
-    return TRUE;
+    for (guint i = 0; i < G_N_ELEMENTS(commands); i++) g_free(commands[i]);
+    return ok;
 }
 
-// Update status display with current system information
-static void update_status_display(AppData *data) {
-    update_status_card(data->gpu_icon_label, data->gpu_status_label,
-                      data->system_info.gpu_detected ? "[OK]" : "[FAIL]",
-                      data->system_info.gpu_info,
-                      data->system_info.gpu_detected ? STATUS_SUCCESS : STATUS_ERROR);
-    
-    update_status_card(data->driver_icon_label, data->driver_status_label,
-                      data->system_info.driver_installed ? "[OK]" : "[WARN]",
-                      data->system_info.driver_info,
-                      data->system_info.driver_installed ? STATUS_SUCCESS : STATUS_WARNING);
-    
-    update_status_card(data->cuda_icon_label, data->cuda_status_label,
-                      data->system_info.cuda_installed ? "[OK]" : "[INFO]",
-                      data->system_info.cuda_info,
-                      data->system_info.cuda_installed ? STATUS_SUCCESS : STATUS_INFO);
+// "Inst name [old] (new repo [arch])" and "Remv name [old]" lines of a simulated run
+static void parse_apt_simulation(const gchar *output, AptTransaction *transaction) {
+    gchar **lines = g_strsplit(output, "\n", -1);
+    for (gchar **line = lines; *line; line++) {
+        gboolean install = g_str_has_prefix(*line, "Inst ");
+        if (!install && !g_str_has_prefix(*line, "Remv ")) continue;
+        
+        gchar **fields = g_strsplit_set(*line + 5, " ", -1);
+        if (!fields[0] || !fields[0][0]) {
+            g_strfreev(fields);
+            continue;
+        }
+        
+        if (install) {
+            // The new version is the first field in parentheses
+            const gchar *version = "";
+            for (gchar **field = fields + 1; *field; field++) {
+                if ((*field)[0] == '(') {
+                    version = *field + 1;
+                    break;
+                }
+            }
+            g_ptr_array_add(transaction->installs, g_strdup_printf("%s %s", fields[0], version));
+        } else {
+            g_ptr_array_add(transaction->removals, g_strdup(fields[0]));
+        }
+        g_strfreev(fields);
+    }
+    g_strfreev(lines);
 }
 
-// Update individual status card
-static void update_status_card(GtkWidget *icon_label, GtkWidget *status_label,
-                              const gchar *icon, const gchar *text, StatusType type) {
-    gchar *icon_markup = g_strdup_printf("<span size='large'>%s</span>", icon);
-    gtk_label_set_markup(GTK_LABEL(icon_label), icon_markup);
-    g_free(icon_markup);
-    
-    gtk_label_set_text(GTK_LABEL(status_label), text);
+// Sum of the sizes in "'uri' file size hash" lines
+static guint64 parse_apt_print_uris(const gchar *output) {
+    guint64 total = 0;
+    gchar **lines = g_strsplit(output, "\n", -1);
+    for (gchar **line = lines; *line; line++) {
+        if ((*line)[0] != '\'') continue;
+        gchar **fields = g_strsplit(*line, " ", -1);
+        if (g_strv_length(fields) >= 3) total += g_ascii_strtoull(fields[2], NULL, 10);
+        g_strfreev(fields);
+    }
+    g_strfreev(lines);
+    return total;
+}
+
+static void clear_apt_transaction(AptTransaction *transaction) {
+    if (transaction->installs) g_ptr_array_free(transaction->installs, TRUE);
+    if (transaction->removals) g_ptr_array_free(transaction->removals, TRUE);
+    transaction->installs = NULL;
+    transaction->removals = NULL;
+}
+
+// Worker thread: show the transaction in a dialog and wait for the answer
+static gboolean confirm_apt_transaction(AppData *data, const AptTransaction *transaction) {
+    GString *message = g_string_new(NULL);
+    gchar *download = g_format_size(transaction->download_bytes);
+    g_string_append_printf(message, "%u packages will be installed, %s to download.\n",
+                           transaction->installs->len, download);
+    g_free(download);
+    
+    if (transaction->removals->len > 0) {
+        g_string_append_printf(message, "\nThese %u packages will be REMOVED:\n", transaction->removals->len);
+        for (guint i = 0; i < transaction->removals->len; i++) {
+            g_string_append_printf(message, "• %s\n", (const gchar *)g_ptr_array_index(transaction->removals, i));
+        }
+    }
     
-    GtkStyleContext *context = gtk_widget_get_style_context(status_label);
-    gtk_style_context_remove_class(context, "status-success");
-    gtk_style_context_remove_class(context, "status-warning");
-    gtk_style_context_remove_class(context, "status-error");
-    gtk_style_context_remove_class(context, "status-info");
+    g_string_append(message, "\n");
+    for (guint i = 0; i < transaction->installs->len && i < TRANSACTION_PREVIEW_MAX; i++) {
+        g_string_append_printf(message, "• %s\n", (const gchar *)g_ptr_array_index(transaction->installs, i));
+    }
+    if (transaction->installs->len > TRANSACTION_PREVIEW_MAX) {
+        g_string_append_printf(message, "...and %u more\n", transaction->installs->len - TRANSACTION_PREVIEW_MAX);
+    }
+    g_string_append(message, "\nContinue?");
+    
+    TransactionPreview preview = {
+        .app_data = data,
+        .message = message->str,
+        .answered = FALSE,
+        .accepted = FALSE,
+    };
+    g_mutex_init(&preview.lock);
+    g_cond_init(&preview.cond);
+    
+    g_idle_add(show_transaction_preview, &preview);
+    g_mutex_lock(&preview.lock);
+    while (!preview.answered) g_cond_wait(&preview.cond, &preview.lock);
+    g_mutex_unlock(&preview.lock);
+    
+    g_cond_clear(&preview.cond);
+    g_mutex_clear(&preview.lock);
+    g_string_free(message, TRUE);
+    return preview.accepted;
+}
+
+static gboolean show_transaction_preview(gpointer user_data) {
+    TransactionPreview *preview = (TransactionPreview *)user_data;
+    gboolean accepted = show_confirmation_dialog(preview->app_data->main_window, "Review Package Changes",
+                                                 preview->message);
+    
+    g_mutex_lock(&preview->lock);
+    preview->accepted = accepted;
+    preview->answered = TRUE;
+    g_cond_signal(&preview->cond);
+    g_mutex_unlock(&preview->lock);
+    return FALSE;
+}
+
+// Start every step whose dependencies finished and whose resources are free, until the plan
+// is done or a step failed and the running ones have drained. Returns the failed step.
+static const InstallStep *run_install_plan(AppData *data, GArray *plan, GKeyFile *checkpoint) {
+    static const guint capacity[INSTALL_RESOURCE_COUNT] = { 1, 2, 1 };
+    
+    InstallScheduler scheduler = {
+        .app_data = data,
+        .plan = plan,
+        .checkpoint = checkpoint,
+        .failed_index = -1,
+    };
+    g_mutex_init(&scheduler.lock);
+    g_cond_init(&scheduler.changed);
+    gint64 start = g_get_monotonic_time();
+    
+    scheduler.history = load_step_history();
+    gdouble expected = 0.0;
+    guint known = 0;
+    for (guint i = 0; i < plan->len; i++) {
+        const InstallStep *step = &g_array_index(plan, InstallStep, i);
+        scheduler.weights[i] = predict_step_seconds(scheduler.history, step, NULL);
+        expected += scheduler.weights[i];
+        if (g_key_file_has_group(scheduler.history, step->id)) known++;
+    }
+    if (known > 0) {
+        // Steps found already done take less, so this is the long end
+        gchar *duration = format_duration(expected);
+        post_log_message(data, STATUS_INFO, "Expected install time from earlier runs on this machine: up to %s (%u of %u steps seen before)",
+                         duration, known, plan->len);
+        g_free(duration);
+    }
+    
+    g_mutex_lock(&scheduler.lock);
+    while (scheduler.finished < plan->len) {
+        for (guint i = 0; i < plan->len && scheduler.failed_index < 0; i++) {
+            const InstallStep *step = &g_array_index(plan, InstallStep, i);
+            if (scheduler.states[i] != INSTALL_STEP_PENDING || !install_step_ready(&scheduler, i)) continue;
+            
+            gboolean fits = TRUE;
+            for (guint r = 0; r < INSTALL_RESOURCE_COUNT; r++) {
+                if ((step->resources & INSTALL_USES(r)) && scheduler.resources_used[r] >= capacity[r]) fits = FALSE;
+            }
+            if (!fits) continue;
+            
+            for (guint r = 0; r < INSTALL_RESOURCE_COUNT; r++) {
+                if (step->resources & INSTALL_USES(r)) scheduler.resources_used[r]++;
+            }
+            scheduler.states[i] = INSTALL_STEP_RUNNING;
+            scheduler.started_us[i] = g_get_monotonic_time();
+            scheduler.running++;
+            
+            InstallStepTask *task = g_malloc(sizeof(InstallStepTask));
+            task->scheduler = &scheduler;
+            task->index = i;
+            if (pthread_create(&scheduler.threads[i], NULL, install_step_thread, task) != 0) {
+                // Fails the step the way install_step_thread would have, nothing is left to signal
+                g_free(task);
+                scheduler.threads[i] = 0;
+                for (guint r = 0; r < INSTALL_RESOURCE_COUNT; r++) {
+                    if (step->resources & INSTALL_USES(r)) scheduler.resources_used[r]--;
+                }
+                scheduler.states[i] = INSTALL_STEP_FAILED;
+                scheduler.finished_us[i] = g_get_monotonic_time();
+                scheduler.failed_index = (gint)i;
+                scheduler.running--;
+                scheduler.finished++;
+                post_log_message(data, STATUS_ERROR, "Cannot start a thread for: %s", step->label);
+            }
+        }
+        
+        // Nothing left that can start
+        if (scheduler.running == 0) break;
+        g_cond_wait(&scheduler.changed, &scheduler.lock);
+    }
+    g_mutex_unlock(&scheduler.lock);
+    
+    for (guint i = 0; i < plan->len; i++) {
+        // Steps still pending or whose thread never started have nothing to join
+        if (scheduler.threads[i]) pthread_join(scheduler.threads[i], NULL);
+    }
+    
+    if (scheduler.failed_index < 0) {
+        post_log_message(data, STATUS_INFO, "All steps finished in %.1f s",
+                         (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC);
+        report_critical_path(&scheduler);
+    }
+    
+    save_step_history(scheduler.history);
+    g_key_file_free(scheduler.history);
+    g_cond_clear(&scheduler.changed);
+    g_mutex_clear(&scheduler.lock);
+    return scheduler.failed_index >= 0 ? &g_array_index(plan, InstallStep, scheduler.failed_index) : NULL;
+}
+
+// Every dependency finished, whether it ran or was skipped
+static gboolean install_step_ready(const InstallScheduler *scheduler, guint index) {
+    guint64 depends = g_array_index(scheduler->plan, InstallStep, index).depends;
+    for (guint i = 0; i < index; i++) {
+        if (!(depends & (G_GUINT64_CONSTANT(1) << i))) continue;
+        if (scheduler->states[i] != INSTALL_STEP_DONE && scheduler->states[i] != INSTALL_STEP_SKIPPED) return FALSE;
+    }
+    return TRUE;
+}
+
+static void *install_step_thread(void *arg) {
+    InstallStepTask *task = (InstallStepTask *)arg;
+    InstallScheduler *scheduler = task->scheduler;
+    guint index = task->index;
+    g_free(task);
+    
+    AppData *data = scheduler->app_data;
+    const InstallStep *step = &g_array_index(scheduler->plan, InstallStep, index);
+    
+    g_mutex_lock(&scheduler->lock);
+    gboolean recorded = step->checkpointed && g_key_file_has_key(scheduler->checkpoint, "steps", step->id, NULL);
+    // The resolve step may have sized this one since the plan started
+    scheduler->weights[index] = predict_step_seconds(scheduler->history, step, NULL);
+    g_mutex_unlock(&scheduler->lock);
+    gint64 started = g_get_monotonic_time();
+    gboolean done = (step->verify && step->verify(step->verify_arg)) ||
+                    (recorded && (!step->artifact || g_file_test(step->artifact, G_FILE_TEST_IS_REGULAR)));
+    
+    InstallStepState state = INSTALL_STEP_SKIPPED;
+    if (done) {
+        post_log_message(data, STATUS_SUCCESS, "%s already done, skipping", step->label);
+    } else {
+        set_step_progress(scheduler, index, 0.0, -1.0, step->label, TRUE);
+        post_log_message(data, STATUS_INFO, "%s", step->message);
+    }
+    
+    if (!done && step->resolves) {
+        state = run_resolve_step(data, scheduler->plan, step) ? INSTALL_STEP_DONE : INSTALL_STEP_FAILED;
+    } else if (!done) {
+        AptSources sources = { NULL, NULL };
+        gchar *command = NULL;
+        if (step->refreshes_lists) {
+            scan_apt_sources(&sources);
+            command = apt_update_command(&sources);
+        }
+        
+        const gchar *run = command ? command : step->command;
+        
+        // apt reports its download and dpkg progress on a descriptor of its own
+        AptStatusProgress progress;
+        CommandSink status = { apt_status_line, &progress };
+        gchar *apt_command = NULL;
+        memset(&progress, 0, sizeof(progress));
+        if (g_str_has_prefix(run, "apt-get ")) {
+            init_apt_status_progress(&progress, scheduler, index);
+            apt_command = g_strdup_printf("apt-get -o APT::Status-Fd=%d %s", APT_STATUS_FD, run + strlen("apt-get "));
+        }
+        
+        gboolean ok = run_command_with_progress(apt_command ? apt_command : run, data, step->timeout_seconds,
+                                                step->as_root, apt_command ? &status : NULL);
+        if (ok && step->refreshes_lists) record_apt_update(&sources, strcmp(command, step->command) == 0);
+        
+        clear_apt_sources(&sources);
+        g_free(apt_command);
+        g_free(command);
+        state = ok ? INSTALL_STEP_DONE : INSTALL_STEP_FAILED;
+        
+        if (ok) {
+            gdouble seconds = (g_get_monotonic_time() - started) / (gdouble)G_USEC_PER_SEC;
+            gdouble download_seconds = progress.download_finished_us > 0
+                ? (progress.download_finished_us - progress.download_started_us) / (gdouble)G_USEC_PER_SEC
+                : 0.0;
+            g_mutex_lock(&scheduler->lock);
+            record_step_history(scheduler->history, step, seconds, download_seconds);
+            g_mutex_unlock(&scheduler->lock);
+        }
+    }
+    
+    if (state != INSTALL_STEP_FAILED) set_step_progress(scheduler, index, 1.0, 0.0, NULL, TRUE);
+    
+    g_mutex_lock(&scheduler->lock);
+    scheduler->states[index] = state;
+    scheduler->finished_us[index] = g_get_monotonic_time();
+    if (state == INSTALL_STEP_DONE && (step->resolves || step->checkpointed)) {
+        if (step->resolves) checkpoint_package_selection(scheduler->checkpoint, step->resolves);
+        if (step->checkpointed) {
+            g_key_file_set_int64(scheduler->checkpoint, "steps", step->id, g_get_real_time() / G_USEC_PER_SEC);
+        }
+        save_install_checkpoint(scheduler->checkpoint);
+    } else if (state == INSTALL_STEP_FAILED && scheduler->failed_index < 0) {
+        scheduler->failed_index = (gint)index;
+    }
+    for (guint r = 0; r < INSTALL_RESOURCE_COUNT; r++) {
+        if (step->resources & INSTALL_USES(r)) scheduler->resources_used[r]--;
+    }
+    scheduler->running--;
+    scheduler->finished++;
+    g_cond_signal(&scheduler->changed);
+    g_mutex_unlock(&scheduler->lock);
+    
+    return NULL;
+}
+
+// Move one step's share of the bar. The bar never goes back: when a step turns out bigger
+// than its first weight said, it holds still until the work catches up. remaining is the
+// step's own estimate of the seconds it has left, negative to go by its weight.
+static void set_step_progress(InstallScheduler *scheduler, guint index, gdouble fraction, gdouble remaining,
+                              const gchar *label, gboolean force) {
+    g_mutex_lock(&scheduler->lock);
+    scheduler->fractions[index] = CLAMP(fraction, 0.0, 1.0);
+    scheduler->remaining[index] = remaining >= 0.0 ? remaining : scheduler->weights[index] * (1.0 - scheduler->fractions[index]);
+    if (label) g_strlcpy(scheduler->progress_label, label, sizeof(scheduler->progress_label));
+    
+    // Steps mostly wait on each other, so what is left adds up
+    gdouble done = 0.0;
+    gdouble total = 0.0;
+    gdouble left = 0.0;
+    for (guint i = 0; i < scheduler->plan->len; i++) {
+        done += scheduler->weights[i] * scheduler->fractions[i];
+        total += scheduler->weights[i];
+        if (scheduler->states[i] == INSTALL_STEP_PENDING) left += scheduler->weights[i];
+        if (scheduler->states[i] == INSTALL_STEP_RUNNING) left += scheduler->remaining[i];
+    }
+    if (total > 0.0) scheduler->progress = MAX(scheduler->progress, 100.0 * done / total);
+    
+    gint64 now = g_get_monotonic_time();
+    if (force || now - scheduler->progress_posted_us >= PROGRESS_POST_INTERVAL_US) {
+        scheduler->progress_posted_us = now;
+        gchar *step_left = format_duration(scheduler->remaining[index]);
+        gchar *install_left = format_duration(left);
+        gchar *text = g_strdup_printf("%s (step: %s left, install: %s left)", scheduler->progress_label, step_left, install_left);
+        post_progress(scheduler->app_data, scheduler->progress, text);
+        g_free(text);
+        g_free(step_left);
+        g_free(install_left);
+    }
+    g_mutex_unlock(&scheduler->lock);
+}
+
+// Splits the step between downloading and dpkg by the predicted length of each. Without a
+// prediction, apt-get update is all download and anything else half and half.
+static void init_apt_status_progress(AptStatusProgress *progress, InstallScheduler *scheduler, guint index) {
+    const InstallStep *step = &g_array_index(scheduler->plan, InstallStep, index);
+    memset(progress, 0, sizeof(*progress));
+    progress->scheduler = scheduler;
+    progress->index = index;
+    progress->download_bytes = step->download_bytes;
+    
+    g_mutex_lock(&scheduler->lock);
+    gdouble seconds = predict_step_seconds(scheduler->history, step, &progress->download_seconds);
+    g_mutex_unlock(&scheduler->lock);
+    if (step->refreshes_lists) progress->download_seconds = seconds;
+    progress->install_seconds = seconds - progress->download_seconds;
+    
+    if (step->refreshes_lists) {
+        progress->download_share = 1.0;
+    } else if (seconds > 0.0 && (step->download_bytes > 0 || step->package_count > 0)) {
+        progress->download_share = progress->download_seconds / seconds;
+    } else {
+        progress->download_share = 0.5;
+    }
+}
+
+// dlstatus:<item>:<percent>:<text> while downloading, pmstatus:<package>:<percent>:<text> while
+// dpkg runs, each phase going from 0 to 100. pmerror and pmconffile lines are left to the
+// console output, which repeats them.
+static void apt_status_line(gpointer user_data, const gchar *line, gboolean is_stderr) {
+    (void)is_stderr;
+    AptStatusProgress *progress = (AptStatusProgress *)user_data;
+    static const gchar download_prefix[] = "dlstatus:";
+    static const gchar dpkg_prefix[] = "pmstatus:";
+    gboolean download = g_str_has_prefix(line, download_prefix);
+    if (!download && !g_str_has_prefix(line, dpkg_prefix)) return;
+    const gchar *fields = line + (download ? sizeof(download_prefix) : sizeof(dpkg_prefix)) - 1;
+    
+    // Package names may carry an :arch suffix, the percent is the first field that is a number
+    gdouble percent = -1.0;
+    const gchar *text = "";
+    for (const gchar *field = strchr(fields, ':'); field; field = strchr(field + 1, ':')) {
+        gchar *end;
+        gdouble value = g_ascii_strtod(field + 1, &end);
+        if (end != field + 1 && *end == ':') {
+            percent = CLAMP(value, 0.0, 100.0);
+            text = end + 1;
+            break;
+        }
+    }
+    if (percent < 0.0) return;
+    
+    gint64 now = g_get_monotonic_time();
+    gchar label[LOG_EVENT_TEXT_MAX];
+    g_strlcpy(label, text, sizeof(label));
+    
+    if (download) {
+        progress->download_percent = percent;
+        if (progress->download_started_us == 0) progress->download_started_us = now;
+        
+        if (progress->download_bytes > 0) {
+            gdouble bytes = progress->download_bytes * percent / 100.0;
+            if (progress->sample_us == 0) {
+                progress->sample_us = now;
+                progress->sample_bytes = bytes;
+            } else if (now - progress->sample_us >= THROUGHPUT_SAMPLE_US) {
+                gdouble rate = (bytes - progress->sample_bytes) * G_USEC_PER_SEC / (now - progress->sample_us);
+                progress->bytes_per_second = progress->bytes_per_second > 0.0
+                    ? THROUGHPUT_SMOOTHING * rate + (1.0 - THROUGHPUT_SMOOTHING) * progress->bytes_per_second
+                    : rate;
+                progress->sample_us = now;
+                progress->sample_bytes = bytes;
+            }
+            
+            gchar *done = g_format_size((guint64)bytes);
+            gchar *total = g_format_size(progress->download_bytes);
+            gchar *speed = g_format_size((guint64)progress->bytes_per_second);
+            if (progress->bytes_per_second > 0.0) {
+                g_snprintf(label, sizeof(label), "Downloading %s of %s at %s/s", done, total, speed);
+            } else {
+                g_snprintf(label, sizeof(label), "Downloading %s of %s", done, total);
+            }
+            g_free(done);
+            g_free(total);
+            g_free(speed);
+        }
+    } else {
+        // dpkg only starts once every archive is in
+        if (progress->download_started_us != 0 && progress->download_finished_us == 0 && progress->download_bytes > 0) {
+            gdouble seconds = MAX((now - progress->download_started_us) / (gdouble)G_USEC_PER_SEC, 0.001);
+            gchar *total = g_format_size(progress->download_bytes);
+            gchar *speed = g_format_size((guint64)(progress->download_bytes / seconds));
+            post_log_message(progress->scheduler->app_data, STATUS_INFO, "Downloaded %s in %.1f s, %s/s",
+                             total, seconds, speed);
+            g_free(total);
+            g_free(speed);
+        }
+        if (progress->download_finished_us == 0) progress->download_finished_us = now;
+        progress->download_percent = 100.0;
+        progress->install_percent = percent;
+    }
+    
+    // The bandwidth measured now beats the one remembered from earlier runs
+    gdouble download_left = progress->download_seconds * (100.0 - progress->download_percent) / 100.0;
+    if (progress->bytes_per_second > 0.0) {
+        download_left = progress->download_bytes * (100.0 - progress->download_percent) / 100.0 / progress->bytes_per_second;
+    }
+    gdouble remaining = download_left + progress->install_seconds * (100.0 - progress->install_percent) / 100.0;
+    
+    gdouble fraction = (progress->download_share * progress->download_percent +
+                        (1.0 - progress->download_share) * progress->install_percent) / 100.0;
+    set_step_progress(progress->scheduler, progress->index, fraction, remaining, label, FALSE);
+}
+
+// Expected duration of an apt transaction of this size, from the assumed rates
+static gdouble apt_transaction_seconds(guint64 download_bytes, guint package_count, gdouble *download_seconds) {
+    gdouble download = download_bytes / APT_ASSUMED_DOWNLOAD_BPS;
+    if (download_seconds) *download_seconds = download;
+    return download + download_bytes / APT_ASSUMED_UNPACK_BPS + package_count * APT_ASSUMED_SECONDS_PER_PACKAGE;
+}
+
+// Seconds the step should take: the local work it took on earlier runs, scaled by how many
+// packages it installs this time, plus its download at the remembered bandwidth. A step
+// never seen before falls back to the assumed rates, or to its timeout.
+static gdouble predict_step_seconds(GKeyFile *history, const InstallStep *step, gdouble *download_seconds) {
+    gdouble bandwidth = g_key_file_get_double(history, "network", "bytes_per_second", NULL);
+    gdouble download = step->download_bytes / (bandwidth > 0.0 ? bandwidth : APT_ASSUMED_DOWNLOAD_BPS);
+    if (download_seconds) *download_seconds = download;
+    
+    if (g_key_file_has_group(history, step->id)) {
+        gdouble local = g_key_file_get_double(history, step->id, "seconds", NULL);
+        gdouble packages = g_key_file_get_double(history, step->id, "packages", NULL);
+        if (step->package_count > 0 && packages > 0.0) local *= step->package_count / packages;
+        return local + download;
+    }
+    if (step->download_bytes > 0 || step->package_count > 0) {
+        return download + apt_transaction_seconds(step->download_bytes, step->package_count, NULL) -
+               step->download_bytes / APT_ASSUMED_DOWNLOAD_BPS;
+    }
+    return (gdouble)step->timeout_seconds / INSTALL_TIMEOUT_HEADROOM;
+}
+
+// Fold a finished run of the step into its moving averages. Download time is kept apart, it
+// goes into the bandwidth shared by every step.
+static void record_step_history(GKeyFile *history, const InstallStep *step, gdouble seconds, gdouble download_seconds) {
+    const gdouble a = STEP_HISTORY_SMOOTHING;
+    gboolean seen = g_key_file_has_group(history, step->id);
+    gdouble local = MAX(seconds - download_seconds, 0.0);
+    
+    if (seen) local = a * local + (1.0 - a) * g_key_file_get_double(history, step->id, "seconds", NULL);
+    g_key_file_set_double(history, step->id, "seconds", local);
+    if (step->package_count > 0) {
+        gdouble packages = step->package_count;
+        if (g_key_file_has_key(history, step->id, "packages", NULL)) {
+            packages = a * packages + (1.0 - a) * g_key_file_get_double(history, step->id, "packages", NULL);
+        }
+        g_key_file_set_double(history, step->id, "packages", packages);
+    }
+    g_key_file_set_integer(history, step->id, "runs", (seen ? g_key_file_get_integer(history, step->id, "runs", NULL) : 0) + 1);
+    g_key_file_set_int64(history, step->id, "last_run", g_get_real_time() / G_USEC_PER_SEC);
+    
+    if (step->download_bytes > 0 && download_seconds >= STEP_HISTORY_MIN_DOWNLOAD_S) {
+        gdouble bandwidth = step->download_bytes / download_seconds;
+        if (g_key_file_has_key(history, "network", "bytes_per_second", NULL)) {
+            bandwidth = a * bandwidth + (1.0 - a) * g_key_file_get_double(history, "network", "bytes_per_second", NULL);
+        }
+        g_key_file_set_double(history, "network", "bytes_per_second", bandwidth);
+    }
+}
+
+static gchar *step_history_path(void) {
+    return app_state_path(STEP_HISTORY_FILE);
+}
+
+// Empty when there is no history yet
+static GKeyFile *load_step_history(void) {
+    GKeyFile *history = g_key_file_new();
+    gchar *path = step_history_path();
+    g_key_file_load_from_file(history, path, G_KEY_FILE_NONE, NULL);
+    g_free(path);
+    return history;
+}
+
+static void save_step_history(GKeyFile *history) {
+    gchar *path = step_history_path();
+    gchar *directory = g_path_get_dirname(path);
+    GError *error = NULL;
+    
+    if (g_mkdir_with_parents(directory, 0700) != 0 || !g_key_file_save_to_file(history, path, &error)) {
+        fprintf(stderr, "Cannot save %s: %s\n", path, error ? error->message : g_strerror(errno));
+        g_clear_error(&error);
+    }
+    
+    g_free(directory);
+    g_free(path);
+}
+
+// Rounded the way a time estimate should be: 45 s, 6 min, 1 h 10 min
+static gchar *format_duration(gdouble seconds) {
+    gint total = (gint)(seconds + 0.5);
+    if (total < 60) return g_strdup_printf("%d s", total);
+    gint minutes = (total + 30) / 60;
+    if (minutes < 60) return g_strdup_printf("%d min", minutes);
+    return g_strdup_printf("%d h %d min", minutes / 60, minutes % 60);
+}
+
+// Walk back from the last step to finish through whatever held it up, a dependency or a
+// step holding a resource it needed. Those are the steps worth speeding up.
+static void report_critical_path(const InstallScheduler *scheduler) {
+    const GArray *plan = scheduler->plan;
+    gint last = -1;
+    for (guint i = 0; i < plan->len; i++) {
+        if (last < 0 || scheduler->finished_us[i] > scheduler->finished_us[last]) last = (gint)i;
+    }
+    if (last < 0) return;
+    
+    GString *report = g_string_new(NULL);
+    gint first = last;
+    for (gint i = last; i >= 0;) {
+        const InstallStep *step = &g_array_index(plan, InstallStep, i);
+        gchar *entry = g_strdup_printf("%s (%.1f s)%s", step->id,
+                                       (scheduler->finished_us[i] - scheduler->started_us[i]) / (gdouble)G_USEC_PER_SEC,
+                                       report->len ? " -> " : "");
+        g_string_prepend(report, entry);
+        g_free(entry);
+        first = i;
+        
+        gint blocker = -1;
+        for (guint j = 0; j < plan->len; j++) {
+            const InstallStep *other = &g_array_index(plan, InstallStep, j);
+            gboolean related = (step->depends & (G_GUINT64_CONSTANT(1) << j)) || (step->resources & other->resources);
+            if ((gint)j == i || !related || scheduler->finished_us[j] > scheduler->started_us[i]) continue;
+            if (blocker < 0 || scheduler->finished_us[j] > scheduler->finished_us[blocker]) blocker = (gint)j;
+        }
+        i = blocker;
+    }
+    
+    post_log_message(scheduler->app_data, STATUS_INFO, "Critical path, %.1f s: %s",
+                     (scheduler->finished_us[last] - scheduler->started_us[first]) / (gdouble)G_USEC_PER_SEC,
+                     report->str);
+    g_string_free(report, TRUE);
+}
+
+static void clear_install_step(gpointer data) {
+    InstallStep *step = (InstallStep *)data;
+    g_free(step->command);
+    g_free(step->verify_arg);
+    g_free(step->artifact);
+}
+
+static InstallStep *plan_last_step(GArray *plan) {
+    return &g_array_index(plan, InstallStep, plan->len - 1);
+}
+
+static gchar *install_checkpoint_path(void) {
+    return app_state_path(INSTALL_CHECKPOINT_FILE);
+}
+
+// Checkpoints of an earlier run for the same choices, or an empty one. The fingerprint covers
+// what the resolve step decides from, so a changed selection, repository or kernel starts over;
+// otherwise the packages it resolved are restored into selection and pinned.
+static GKeyFile *load_install_checkpoint(AppData *data, PackageSelection *selection) {
+    gchar *inputs = g_strdup_printf("%d\t%d\t%s\t%s\t%s", selection->install_driver, selection->install_cuda,
+                                    data->system_info.nvidia_repo_id ? data->system_info.nvidia_repo_id : "",
+                                    get_host_facts()->cuda_repo_arch ? get_host_facts()->cuda_repo_arch : "",
+                                    get_host_facts()->kernel_release);
+    gchar *fingerprint = g_compute_checksum_for_string(G_CHECKSUM_SHA256, inputs, -1);
+    g_free(inputs);
+    
+    GKeyFile *checkpoint = g_key_file_new();
+    gchar *path = install_checkpoint_path();
+    gboolean loaded = g_key_file_load_from_file(checkpoint, path, G_KEY_FILE_NONE, NULL);
+    gchar *saved = loaded ? g_key_file_get_string(checkpoint, "plan", "fingerprint", NULL) : NULL;
+    
+    if (g_strcmp0(saved, fingerprint) != 0) {
+        g_key_file_free(checkpoint);
+        checkpoint = g_key_file_new();
+        g_key_file_set_string(checkpoint, "plan", "fingerprint", fingerprint);
+    } else if (g_key_file_has_group(checkpoint, "selection")) {
+        clear_package_selection(selection);
+        selection->driver = g_key_file_get_string(checkpoint, "selection", "driver", NULL);
+        selection->driver_modules = g_key_file_get_string(checkpoint, "selection", "driver-modules", NULL);
+        selection->toolkit = g_key_file_get_string(checkpoint, "selection", "toolkit", NULL);
+        selection->keyring_deb = g_key_file_get_string(checkpoint, "selection", "keyring-deb", NULL);
+        selection->pinned = selection->keyring_deb != NULL;
+    }
+    
+    g_free(saved);
+    g_free(path);
+    g_free(fingerprint);
+    return checkpoint;
+}
+
+// What the resolve step settled on, missing keys for the parts not selected
+static void checkpoint_package_selection(GKeyFile *checkpoint, const PackageSelection *selection) {
+    const struct {
+        const gchar *key;
+        const gchar *value;
+    } parts[] = {
+        { "driver", selection->driver },
+        { "driver-modules", selection->driver_modules },
+        { "toolkit", selection->toolkit },
+        { "keyring-deb", selection->keyring_deb },
+    };
+    g_key_file_remove_group(checkpoint, "selection", NULL);
+    for (gsize i = 0; i < G_N_ELEMENTS(parts); i++) {
+        if (parts[i].value) g_key_file_set_string(checkpoint, "selection", parts[i].key, parts[i].value);
+    }
+}
+
+static void save_install_checkpoint(GKeyFile *checkpoint) {
+    gchar *path = install_checkpoint_path();
+    gchar *directory = g_path_get_dirname(path);
+    GError *error = NULL;
+    
+    if (g_mkdir_with_parents(directory, 0700) != 0 || !g_key_file_save_to_file(checkpoint, path, &error)) {
+        fprintf(stderr, "Cannot save %s: %s\n", path, error ? error->message : g_strerror(errno));
+        g_clear_error(&error);
+    }
+    
+    g_free(directory);
+    g_free(path);
+}
+
+// Every package in the space separated list is fully installed and configured, and no older
+// than the lists offer it. Only the packages the lists index are held to a version.
+static gboolean packages_installed(const gchar *packages) {
+    gboolean installed = TRUE;
+    const gchar *name = packages;
+    
+    while (installed && *name) {
+        gsize length = strcspn(name, " ");
+        if (length > 0) {
+            gchar *version = NULL;
+            installed = dpkg_package_installed(name, length, &version);
+            gchar *candidate = installed ? apt_candidate_version(name, length) : NULL;
+            if (candidate) {
+                const gchar *current = version ? version : "";
+                installed = compare_package_versions(current, strlen(current), candidate, strlen(candidate)) >= 0;
+            }
+            g_free(candidate);
+            g_free(version);
+        }
+        name += length;
+        while (*name == ' ') name++;
+    }
+    return installed;
+}
+
+// The dpkg status index is built on first use and rebuilt once dpkg has replaced the file
+static DpkgStatusIndex dpkg_status_index = { NULL, { NULL, 0, 0 }, { 0 } };
+static GMutex dpkg_status_lock;
+
+// Microseconds per query once the index is built, no dpkg-query process. The installed version
+// is copied into version, the mapping may be replaced once the lock is dropped.
+static gboolean dpkg_package_installed(const gchar *name, gsize name_length, gchar **version) {
+    g_mutex_lock(&dpkg_status_lock);
+    gboolean installed = FALSE;
+    if (refresh_dpkg_status_index()) {
+        const PackageStanza *package = find_package_stanza(&dpkg_status_index.packages, name, name_length);
+        installed = package && stanza_is_installed(package);
+        if (installed && version && package->version) *version = g_strndup(package->version, package->version_length);
+    }
+    g_mutex_unlock(&dpkg_status_lock);
+    return installed;
+}
+
+// Map the status file again if dpkg renamed a new one into place or rewrote it; the old
+// mapping stays valid until then since dpkg never edits the file in place
+static gboolean refresh_dpkg_status_index(void) {
+    DpkgStatusIndex *index = &dpkg_status_index;
+    struct stat st;
+    if (stat(DPKG_STATUS_PATH, &st) != 0) return index->file != NULL;
+    
+    if (index->file && st.st_ino == index->source.st_ino && st.st_dev == index->source.st_dev &&
+        st.st_size == index->source.st_size && st.st_mtim.tv_sec == index->source.st_mtim.tv_sec &&
+        st.st_mtim.tv_nsec == index->source.st_mtim.tv_nsec) {
+        return TRUE;
+    }
+    
+    GMappedFile *file = g_mapped_file_new(DPKG_STATUS_PATH, FALSE, NULL);
+    if (!file) return index->file != NULL;
+    
+    if (index->file) g_mapped_file_unref(index->file);
+    clear_package_index(&index->packages);
+    index->file = file;
+    index->source = st;
+    init_package_index(&index->packages, DPKG_INDEX_MIN_SLOTS);
+    index_package_stanzas(&index->packages, g_mapped_file_get_contents(file), g_mapped_file_get_length(file),
+                          NULL, merge_dpkg_stanza);
+    return TRUE;
+}
+
+// Candidate versions for packages_installed, the lists index is built on first use and rebuilt
+// once apt-get update has renamed new lists into place
+static AptListsIndex apt_lists_index = { NULL, { NULL, 0, 0 }, { 0 } };
+static GMutex apt_lists_lock;
+
+// The newest version any list offers, NULL for a package the lists don't have or don't index
+static gchar *apt_candidate_version(const gchar *name, gsize name_length) {
+    g_mutex_lock(&apt_lists_lock);
+    refresh_apt_lists_index();
+    const PackageStanza *package = find_package_stanza(&apt_lists_index.packages, name, name_length);
+    gchar *version = package && package->version ? g_strndup(package->version, package->version_length) : NULL;
+    g_mutex_unlock(&apt_lists_lock);
+    return version;
+}
+
+static void refresh_apt_lists_index(void) {
+    AptListsIndex *index = &apt_lists_index;
+    struct stat st;
+    if (index->files && (stat(APT_LISTS_DIR, &st) != 0 ||
+                         (st.st_mtim.tv_sec == index->source.st_mtim.tv_sec &&
+                          st.st_mtim.tv_nsec == index->source.st_mtim.tv_nsec))) {
+        return;
+    }
+    
+    if (index->files) clear_apt_lists_index(index);
+    load_apt_lists_index(index);
+}
+
+// Multi-arch packages appear once per architecture; an installed stanza wins
+static void merge_dpkg_stanza(PackageStanza *existing, const PackageStanza *candidate) {
+    if (!stanza_is_installed(existing) && stanza_is_installed(candidate)) {
+        guint32 hash = existing->hash;
+        *existing = *candidate;
+        existing->hash = hash;
+    }
+}
+
+static gboolean stanza_is_installed(const PackageStanza *stanza) {
+    static const gchar installed[] = "install ok installed";
+    return stanza->status_length == sizeof(installed) - 1 &&
+           memcmp(stanza->status, installed, sizeof(installed) - 1) == 0;
+}
+
+// One pass over the stanzas of a dpkg status or apt Packages file. Package is the first field
+// of a stanza, so one wanted turns down is skipped to its blank line without reading the rest.
+static void index_package_stanzas(PackageIndex *index, const gchar *contents, gsize length,
+                                  gboolean (*wanted)(const gchar *name, gsize length),
+                                  void (*merge)(PackageStanza *existing, const PackageStanza *candidate)) {
+    const gchar *end = contents + length;
+    const gchar *line = contents;
+    PackageStanza stanza;
+    memset(&stanza, 0, sizeof(stanza));
+    
+    while (line < end) {
+        const gchar *eol = memchr(line, '\n', end - line);
+        if (!eol) eol = end;
+        gsize line_length = eol - line;
+        
+        if (line_length == 0) {
+            if (stanza.name) insert_package_stanza(index, &stanza, merge);
+            memset(&stanza, 0, sizeof(stanza));
+        } else if (line_length > 9 && memcmp(line, "Package: ", 9) == 0) {
+            stanza.name = line + 9;
+            stanza.name_length = (guint32)(line_length - 9);
+            if (wanted && !wanted(stanza.name, stanza.name_length)) {
+                const gchar *blank = memmem(eol, end - eol, "\n\n", 2);
+                stanza.name = NULL;
+                line = blank ? blank + 1 : end;
+                continue;
+            }
+        } else if (stanza.name && line_length > 9 && memcmp(line, "Version: ", 9) == 0) {
+            stanza.version = line + 9;
+            stanza.version_length = (guint32)(line_length - 9);
+        } else if (stanza.name && line_length > 8 && memcmp(line, "Status: ", 8) == 0) {
+            stanza.status = line + 8;
+            stanza.status_length = (guint32)(line_length - 8);
+        } else if (stanza.name && line_length > 10 && memcmp(line, "Filename: ", 10) == 0) {
+            stanza.filename = line + 10;
+            stanza.filename_length = (guint32)(line_length - 10);
+        } else if (stanza.name && line_length > 12 && memcmp(line, "Modaliases: ", 12) == 0) {
+            stanza.modaliases = line + 12;
+            stanza.modaliases_length = (guint32)(line_length - 12);
+        } else if (stanza.name && line_length > 9 && memcmp(line, "Depends: ", 9) == 0) {
+            stanza.depends = line + 9;
+            stanza.depends_length = (guint32)(line_length - 9);
+        }
+        line = eol + 1;
+    }
+    if (stanza.name) insert_package_stanza(index, &stanza, merge);
+}
+
+static void init_package_index(PackageIndex *index, guint capacity) {
+    index->slots = g_new0(PackageStanza, capacity);
+    index->capacity = capacity;
+    index->count = 0;
+}
+
+static void clear_package_index(PackageIndex *index) {
+    g_free(index->slots);
+    index->slots = NULL;
+    index->capacity = 0;
+    index->count = 0;
+}
+
+// A name already in the index goes to merge, which decides what its slot keeps
+static void insert_package_stanza(PackageIndex *index, const PackageStanza *stanza,
+                                  void (*merge)(PackageStanza *existing, const PackageStanza *candidate)) {
+    if (index->count * 2 >= index->capacity) {
+        PackageStanza *old = index->slots;
+        guint old_capacity = index->capacity;
+        index->capacity *= 2;
+        index->slots = g_new0(PackageStanza, index->capacity);
+        for (guint i = 0; i < old_capacity; i++) {
+            if (!old[i].name) continue;
+            guint j = old[i].hash & (index->capacity - 1);
+            while (index->slots[j].name) j = (j + 1) & (index->capacity - 1);
+            index->slots[j] = old[i];
+        }
+        g_free(old);
+    }
+    
+    guint32 hash = hash_package_name(stanza->name, stanza->name_length);
+    guint i = hash & (index->capacity - 1);
+    for (; index->slots[i].name; i = (i + 1) & (index->capacity - 1)) {
+        PackageStanza *slot = &index->slots[i];
+        if (slot->hash == hash && slot->name_length == stanza->name_length &&
+            memcmp(slot->name, stanza->name, stanza->name_length) == 0) {
+            merge(slot, stanza);
+            return;
+        }
+    }
+    index->slots[i] = *stanza;
+    index->slots[i].hash = hash;
+    index->count++;
+}
+
+static const PackageStanza *find_package_stanza(const PackageIndex *index, const gchar *name, gsize name_length) {
+    if (index->capacity == 0) return NULL;
+    
+    guint32 hash = hash_package_name(name, name_length);
+    for (guint i = hash & (index->capacity - 1); index->slots[i].name; i = (i + 1) & (index->capacity - 1)) {
+        const PackageStanza *slot = &index->slots[i];
+        if (slot->hash == hash && slot->name_length == name_length && memcmp(slot->name, name, name_length) == 0) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+// FNV-1a
+static guint32 hash_package_name(const gchar *name, gsize length) {
+    guint32 hash = 2166136261u;
+    for (gsize i = 0; i < length; i++) {
+        hash ^= (guchar)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// dpkg's ordering: epoch, then upstream version, then Debian revision
+static gint compare_package_versions(const gchar *a, gsize a_length, const gchar *b, gsize b_length) {
+    const gchar *versions[2] = { a, b };
+    const gchar *ends[2] = { a + a_length, b + b_length };
+    const gchar *revisions[2];
+    guint64 epochs[2];
+    
+    for (guint i = 0; i < 2; i++) {
+        const gchar *colon = memchr(versions[i], ':', ends[i] - versions[i]);
+        epochs[i] = colon ? g_ascii_strtoull(versions[i], NULL, 10) : 0;
+        if (colon) versions[i] = colon + 1;
+        
+        // The revision starts after the last hyphen, a version without one has none
+        revisions[i] = ends[i];
+        for (const gchar *c = ends[i]; c > versions[i]; c--) {
+            if (c[-1] == '-') {
+                revisions[i] = c - 1;
+                break;
+            }
+        }
+    }
+    
+    if (epochs[0] != epochs[1]) return epochs[0] < epochs[1] ? -1 : 1;
+    gint result = compare_version_part(versions[0], revisions[0], versions[1], revisions[1]);
+    if (result != 0) return result;
+    return compare_version_part(revisions[0] + (revisions[0] < ends[0]), ends[0],
+                                revisions[1] + (revisions[1] < ends[1]), ends[1]);
+}
+
+// Alternating runs of non-digits, compared character by character, and digits, compared
+// as numbers
+static gint compare_version_part(const gchar *a, const gchar *a_end, const gchar *b, const gchar *b_end) {
+    while (a < a_end || b < b_end) {
+        while ((a < a_end && !g_ascii_isdigit(*a)) || (b < b_end && !g_ascii_isdigit(*b))) {
+            gint a_order = version_char_order(a, a_end);
+            gint b_order = version_char_order(b, b_end);
+            if (a_order != b_order) return a_order - b_order;
+            a++;
+            b++;
+        }
+        
+        while (a < a_end && *a == '0') a++;
+        while (b < b_end && *b == '0') b++;
+        gint first_difference = 0;
+        while (a < a_end && g_ascii_isdigit(*a) && b < b_end && g_ascii_isdigit(*b)) {
+            if (!first_difference) first_difference = *a - *b;
+            a++;
+            b++;
+        }
+        if (a < a_end && g_ascii_isdigit(*a)) return 1;
+        if (b < b_end && g_ascii_isdigit(*b)) return -1;
+        if (first_difference) return first_difference;
+    }
+    return 0;
+}
+
+// ~ sorts before the end of the version, letters before any other character
+static gint version_char_order(const gchar *c, const gchar *end) {
+    if (c >= end || g_ascii_isdigit(*c)) return 0;
+    if (g_ascii_isalpha(*c)) return *c;
+    if (*c == '~') return -1;
+    return *c + 256;
+}
+
+// Maps every uncompressed Packages list; the stanzas of the few packages the install picks
+// between are indexed and the rest skipped, so this costs milliseconds, not an apt-cache run
+static void load_apt_lists_index(AptListsIndex *index) {
+    index->files = g_ptr_array_new_with_free_func((GDestroyNotify)g_mapped_file_unref);
+    init_package_index(&index->packages, APT_INDEX_MIN_SLOTS);
+    // Taken first, lists renamed in while they are read make the next refresh load again
+    if (stat(APT_LISTS_DIR, &index->source) != 0) memset(&index->source, 0, sizeof(index->source));
+    
+    GDir *dir = g_dir_open(APT_LISTS_DIR, 0, NULL);
+    if (!dir) return;
+    
+    const gchar *name;
+    while ((name = g_dir_read_name(dir))) {
+        if (!g_str_has_suffix(name, "_Packages")) continue;
+        
+        gchar *path = g_build_filename(APT_LISTS_DIR, name, NULL);
+        GMappedFile *file = g_mapped_file_new(path, FALSE, NULL);
+        g_free(path);
+        if (!file) continue;
+        
+        g_ptr_array_add(index->files, file);
+        index_package_stanzas(&index->packages, g_mapped_file_get_contents(file), g_mapped_file_get_length(file),
+                              apt_package_wanted, merge_apt_stanza);
+    }
+    g_dir_close(dir);
+}
+
+static void clear_apt_lists_index(AptListsIndex *index) {
+    clear_package_index(&index->packages);
+    g_ptr_array_unref(index->files);
+    index->files = NULL;
+}
+
+static gboolean apt_package_wanted(const gchar *name, gsize length) {
+    static const gchar *const prefixes[] = {
+        "cuda-drivers-", "cuda-toolkit-", "cuda-runtime-", "cuda-keyring", "nvidia-driver-",
+        "nvidia-kernel-common-", "linux-modules-nvidia-",
+    };
+    for (gsize i = 0; i < G_N_ELEMENTS(prefixes); i++) {
+        gsize prefix_length = strlen(prefixes[i]);
+        if (length >= prefix_length && memcmp(name, prefixes[i], prefix_length) == 0) return TRUE;
+    }
+    return FALSE;
+}
+
+// Every version of a package across all lists: the newest wins. NVIDIA's repository publishes
+// its driver packages without Modaliases, so those are kept from whichever list has them.
+static void merge_apt_stanza(PackageStanza *existing, const PackageStanza *candidate) {
+    const gchar *modaliases = existing->modaliases;
+    guint32 modaliases_length = existing->modaliases_length;
+    
+    if (compare_package_versions(candidate->version, candidate->version_length,
+                                 existing->version, existing->version_length) > 0) {
+        guint32 hash = existing->hash;
+        *existing = *candidate;
+        existing->hash = hash;
+    }
+    if (!existing->modaliases) {
+        existing->modaliases = modaliases ? modaliases : candidate->modaliases;
+        existing->modaliases_length = modaliases ? modaliases_length : candidate->modaliases_length;
+    }
+}
+
+// The newest driver branch for the detected GPUs, with its precompiled modules for the running
+// kernel when they fit the driver apt will pick, then the newest toolkit that branch can run. Whatever the lists don't
+// have yet, before NVIDIA's repository was first added, falls back to the metapackages.
+static void resolve_package_selection(AppData *data, PackageSelection *selection) {
+    AptListsIndex lists;
+    load_apt_lists_index(&lists);
+    
+    g_free(selection->driver);
+    g_free(selection->driver_modules);
+    g_free(selection->toolkit);
+    g_free(selection->keyring_deb);
+    selection->driver = NULL;
+    selection->driver_modules = NULL;
+    selection->toolkit = NULL;
+    
+    gchar *driver_version = NULL;   // What the toolkit has to run on, NULL for any
+    if (selection->install_driver) {
+        gboolean precompiled = FALSE;
+        gint branch = select_driver_branch(&lists.packages, data->system_info.gpus, &precompiled);
+        selection->driver = branch ? g_strdup_printf("cuda-drivers-%d", branch) : g_strdup(CUDA_DRIVERS_FALLBACK);
+        if (precompiled) {
+            selection->driver_modules = g_strdup_printf("linux-modules-nvidia-%d-%s", branch, get_host_facts()->kernel_release);
+        }
+        const PackageStanza *driver = branch ? find_package_stanza(&lists.packages, selection->driver, strlen(selection->driver)) : NULL;
+        if (driver && driver->version) driver_version = g_strndup(driver->version, driver->version_length);
+    } else if (data->system_info.driver_userspace_version) {
+        // The toolkit has to run on the driver that stays
+        driver_version = g_strdup(data->system_info.driver_userspace_version);
+    }
+    
+    if (selection->install_cuda) {
+        selection->toolkit = select_cuda_toolkit(&lists.packages, driver_version);
+        if (!selection->toolkit && driver_version) {
+            selection->toolkit = select_cuda_toolkit(&lists.packages, NULL);
+            if (selection->toolkit) {
+                post_log_message(data, STATUS_WARNING, "No CUDA toolkit in the repository is known to run on driver %s, %s needs a newer one",
+                                 driver_version, selection->toolkit);
+            }
+        }
+        if (!selection->toolkit) selection->toolkit = g_strdup(CUDA_TOOLKIT_FALLBACK);
+    }
+    g_free(driver_version);
+    
+    const PackageStanza *keyring = find_package_stanza(&lists.packages, "cuda-keyring", strlen("cuda-keyring"));
+    if (keyring && keyring->filename) {
+        const gchar *base = keyring->filename + keyring->filename_length;
+        while (base > keyring->filename && base[-1] != '/') base--;
+        selection->keyring_deb = g_strndup(base, keyring->filename + keyring->filename_length - base);
+    } else {
+        selection->keyring_deb = g_strdup(CUDA_KEYRING_FALLBACK_DEB);
+    }
+    
+    clear_apt_lists_index(&lists);
+}
+
+// The newest cuda-drivers-NNN branch the GPUs are supported by, 0 when the lists have none.
+// DKMS builds the modules for any branch, so precompiled ones only say whether it can skip that.
+static gint select_driver_branch(const PackageIndex *packages, const GArray *gpus, gboolean *precompiled) {
+    static const gchar prefix[] = "cuda-drivers-";
+    gint best = 0;
+    
+    for (guint i = 0; i < packages->capacity; i++) {
+        const PackageStanza *stanza = &packages->slots[i];
+        if (!stanza->name || stanza->name_length <= sizeof(prefix) - 1 ||
+            memcmp(stanza->name, prefix, sizeof(prefix) - 1) != 0) {
+            continue;
+        }
+        
+        // Only cuda-drivers-NNN, not cuda-drivers-fabricmanager-NNN and the like
+        gint branch = 0;
+        const gchar *c = stanza->name + sizeof(prefix) - 1;
+        for (; c < stanza->name + stanza->name_length && g_ascii_isdigit(*c); c++) branch = branch * 10 + (*c - '0');
+        if (c != stanza->name + stanza->name_length || !driver_branch_supports(packages, branch, gpus)) continue;
+        
+        if (branch > best) best = branch;
+    }
+    *precompiled = best > 0 && driver_modules_match(packages, best);
+    return best;
+}
+
+// A branch supports the GPUs its driver package lists in Modaliases. A branch nobody publishes
+// Modaliases for gets the benefit of the doubt.
+static gboolean driver_branch_supports(const PackageIndex *packages, gint branch, const GArray *gpus) {
+    if (!gpus) return TRUE;
+    
+    gchar name[32];
+    g_snprintf(name, sizeof(name), "nvidia-driver-%d", branch);
+    const PackageStanza *driver = find_package_stanza(packages, name, strlen(name));
+    if (!driver || !driver->modaliases) return TRUE;
+    
+    for (guint i = 0; i < gpus->len; i++) {
+        // As in pci:v000010DEd00002684sv*sd*bc03sc*i*
+        gchar alias[32];
+        g_snprintf(alias, sizeof(alias), "v%08Xd%08X", NVIDIA_PCI_VENDOR_ID, g_array_index(gpus, GpuDevice, i).device_id);
+        if (!memmem(driver->modaliases, driver->modaliases_length, alias, strlen(alias))) return FALSE;
+    }
+    return TRUE;
+}
+
+// linux-modules-nvidia-NNN-<kernel> comes from the distribution archive and pins
+// nvidia-kernel-common-NNN to the release it was built against, while cuda-drivers-NNN pulls
+// the newest one in. Both only resolve in one transaction when that candidate meets every pin.
+static gboolean driver_modules_match(const PackageIndex *packages, gint branch) {
+    gchar *modules_name = g_strdup_printf("linux-modules-nvidia-%d-%s", branch, get_host_facts()->kernel_release);
+    gchar *common_name = g_strdup_printf("nvidia-kernel-common-%d", branch);
+    gchar *driver_name = g_strdup_printf("cuda-drivers-%d", branch);
+    const PackageStanza *modules = find_package_stanza(packages, modules_name, strlen(modules_name));
+    // Without the package in the lists the driver release stands in for it, they share versions
+    const PackageStanza *common = find_package_stanza(packages, common_name, strlen(common_name));
+    if (!common) common = find_package_stanza(packages, driver_name, strlen(driver_name));
+    
+    gboolean pinned = FALSE;
+    gboolean match = FALSE;
+    if (modules && common && common->version) {
+        gchar *candidate = g_strndup(common->version, common->version_length);
+        match = depends_relations_hold(modules, common_name, candidate, &pinned);
+        g_free(candidate);
+    }
+    
+    g_free(modules_name);
+    g_free(common_name);
+    g_free(driver_name);
+    return match && pinned;
+}
+
+// Every versioned relation on name in the stanza's Depends, as in "cuda-drivers (>= 560.35.03)",
+// holds for version. Clauses with alternatives constrain nothing on their own and are passed
+// over; related says whether any relation was found.
+static gboolean depends_relations_hold(const PackageStanza *stanza, const gchar *name, const gchar *version,
+                                       gboolean *related) {
+    *related = FALSE;
+    if (!stanza->depends) return TRUE;
+    
+    gchar *depends = g_strndup(stanza->depends, stanza->depends_length);
+    gchar **clauses = g_strsplit(depends, ",", -1);
+    gboolean hold = TRUE;
+    
+    for (gchar **clause = clauses; *clause && hold; clause++) {
+        gchar package[128];
+        gchar relation[3];
+        gchar bound[128];
+        if (strchr(*clause, '|') ||
+            sscanf(*clause, " %127s (%2[<>=] %127[^) ])", package, relation, bound) != 3 ||
+            strcmp(package, name) != 0) {
+            continue;
+        }
+        *related = TRUE;
+        hold = version_relation_holds(version, relation, bound);
+    }
+    
+    g_strfreev(clauses);
+    g_free(depends);
+    return hold;
+}
+
+// A Depends relation: <<, <=, =, >=, >>, and the obsolete < and > meaning <= and >=
+static gboolean version_relation_holds(const gchar *version, const gchar *relation, const gchar *bound) {
+    gint order = compare_package_versions(version, strlen(version), bound, strlen(bound));
+    if (strcmp(relation, "<<") == 0) return order < 0;
+    if (strcmp(relation, "<=") == 0 || strcmp(relation, "<") == 0) return order <= 0;
+    if (strcmp(relation, "=") == 0) return order == 0;
+    if (strcmp(relation, ">=") == 0 || strcmp(relation, ">") == 0) return order >= 0;
+    if (strcmp(relation, ">>") == 0) return order > 0;
+    return FALSE;
+}
+
+// Newest cuda-toolkit-X-Y that runs on driver_version, any when it is NULL
+static gchar *select_cuda_toolkit(const PackageIndex *packages, const gchar *driver_version) {
+    gint best_major = -1;
+    gint best_minor = -1;
+    
+    for (guint i = 0; i < packages->capacity; i++) {
+        const PackageStanza *stanza = &packages->slots[i];
+        gchar name[64];
+        if (!stanza->name || stanza->name_length >= sizeof(name)) continue;
+        memcpy(name, stanza->name, stanza->name_length);
+        name[stanza->name_length] = '\0';
+        
+        gint major, minor;
+        gint consumed = 0;
+        if (sscanf(name, "cuda-toolkit-%d-%d%n", &major, &minor, &consumed) != 2 ||
+            consumed != (gint)stanza->name_length) {
+            continue;
+        }
+        if (driver_version && !cuda_runs_on_driver(packages, major, minor, driver_version)) continue;
+        if (major > best_major || (major == best_major && minor > best_minor)) {
+            best_major = major;
+            best_minor = minor;
+        }
+    }
+    return best_major >= 0 ? g_strdup_printf("cuda-toolkit-%d-%d", best_major, best_minor) : NULL;
+}
+
+// NVIDIA publishes each release's minimum driver as the cuda-drivers relation of its
+// cuda-runtime-X-Y metapackage, so new releases are followed from the lists. Lists without it
+// fall back to cuda_minimum_driver.
+static gboolean cuda_runs_on_driver(const PackageIndex *packages, gint major, gint minor, const gchar *driver_version) {
+    gchar runtime_name[64];
+    g_snprintf(runtime_name, sizeof(runtime_name), "cuda-runtime-%d-%d", major, minor);
+    const PackageStanza *runtime = find_package_stanza(packages, runtime_name, strlen(runtime_name));
+    
+    gboolean related = FALSE;
+    gboolean runs = runtime && depends_relations_hold(runtime, "cuda-drivers", driver_version, &related);
+    if (related) return runs;
+    
+    gint minimum = cuda_minimum_driver(major, minor);
+    return minimum > 0 && g_ascii_strtoll(driver_version, NULL, 10) >= minimum;
+}
+
+// Driver branch each toolkit release shipped with, 0 for a release newer than the table: what
+// it needs is unknown, so it is not assumed to fit.
+static gint cuda_minimum_driver(gint major, gint minor) {
+    static const struct {
+        gint major;
+        gint minor;
+        gint driver;
+    } releases[] = {
+        { 11, 0, 450 }, { 11, 1, 455 }, { 11, 2, 460 }, { 11, 3, 465 }, { 11, 4, 470 },
+        { 11, 5, 495 }, { 11, 6, 510 }, { 11, 7, 515 }, { 11, 8, 520 },
+        { 12, 0, 525 }, { 12, 1, 530 }, { 12, 2, 535 }, { 12, 3, 545 }, { 12, 4, 550 },
+        { 12, 5, 555 }, { 12, 6, 560 }, { 12, 8, 570 }, { 12, 9, 575 },
+        { 13, 0, 580 },
+    };
+    gsize newest = G_N_ELEMENTS(releases) - 1;
+    if (major > releases[newest].major || (major == releases[newest].major && minor > releases[newest].minor)) {
+        return 0;
+    }
+    
+    // Older releases than the table run on its first branch
+    gint driver = releases[0].driver;
+    for (gsize i = 0; i < G_N_ELEMENTS(releases); i++) {
+        if (releases[i].major < major || (releases[i].major == major && releases[i].minor <= minor)) {
+            driver = releases[i].driver;
+        }
+    }
+    return driver;
+}
+
+// Space separated, as apt-get install takes them
+static gchar *format_package_selection(const PackageSelection *selection) {
+    GString *packages = g_string_new(PREREQUISITE_PACKAGES);
+    if (selection->driver) g_string_append_printf(packages, " %s", selection->driver);
+    if (selection->driver_modules) g_string_append_printf(packages, " %s", selection->driver_modules);
+    if (selection->toolkit) g_string_append_printf(packages, " %s", selection->toolkit);
+    return g_string_free(packages, FALSE);
+}
+
+static void clear_package_selection(PackageSelection *selection) {
+    g_free(selection->driver);
+    g_free(selection->driver_modules);
+    g_free(selection->toolkit);
+    g_free(selection->keyring_deb);
+    selection->driver = NULL;
+    selection->driver_modules = NULL;
+    selection->toolkit = NULL;
+    selection->keyring_deb = NULL;
+}
+
+// The profile script exists and puts the CUDA bin directory on PATH
+static gboolean cuda_environment_configured(const gchar *path) {
+    gchar *contents = NULL;
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) return FALSE;
+    
+    gboolean configured = strstr(contents, "/usr/local/cuda/bin") != NULL &&
+                          strstr(contents, "/usr/local/cuda/lib64") != NULL;
+    g_free(contents);
+    return configured;
+}
+
+// Hash every source file and decide which are stale. A source counts as fetched when the
+// last update we ran saw the same contents, or when apt's own update stamp is newer than
+// the file, so updates run by anything else count too.
+static void scan_apt_sources(AptSources *sources) {
+    sources->digests = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    sources->stale = g_ptr_array_new_with_free_func(g_free);
+    
+    add_apt_source(sources, APT_SOURCES_LIST);
+    GDir *dir = g_dir_open(APT_SOURCES_DIR, 0, NULL);
+    if (dir) {
+        const gchar *name;
+        while ((name = g_dir_read_name(dir)) != NULL) {
+            if (g_str_has_suffix(name, ".list") || g_str_has_suffix(name, ".sources")) {
+                gchar *path = g_build_filename(APT_SOURCES_DIR, name, NULL);
+                add_apt_source(sources, path);
+                g_free(path);
+            }
+        }
+        g_dir_close(dir);
+    }
+    
+    GKeyFile *state = g_key_file_new();
+    gchar *state_path = apt_sources_state_path();
+    g_key_file_load_from_file(state, state_path, G_KEY_FILE_NONE, NULL);
+    g_free(state_path);
+    
+    struct stat stamp;
+    gint64 stamp_time = stat(APT_UPDATE_STAMP, &stamp) == 0 ? (gint64)stamp.st_mtime : 0;
+    gint64 oldest_fresh = g_get_real_time() / G_USEC_PER_SEC - APT_LISTS_MAX_AGE_S;
+    
+    GHashTableIter iter;
+    gpointer path, digest;
+    g_hash_table_iter_init(&iter, sources->digests);
+    while (g_hash_table_iter_next(&iter, &path, &digest)) {
+        gint64 fetched = 0;
+        gchar *recorded = g_key_file_get_string(state, "digests", path, NULL);
+        if (g_strcmp0(recorded, digest) == 0) fetched = g_key_file_get_int64(state, "fetched", path, NULL);
+        g_free(recorded);
+        
+        struct stat st;
+        if (stat(path, &st) == 0 && (gint64)st.st_mtime < stamp_time) fetched = MAX(fetched, stamp_time);
+        if (fetched < oldest_fresh) g_ptr_array_add(sources->stale, g_strdup(path));
+    }
+    
+    g_key_file_free(state);
+}
+
+static void add_apt_source(AptSources *sources, const gchar *path) {
+    gchar *contents = NULL;
+    gsize length = 0;
+    if (!g_file_get_contents(path, &contents, &length, NULL)) return;
+    
+    g_hash_table_insert(sources->digests, g_strdup(path),
+                        g_compute_checksum_for_data(G_CHECKSUM_SHA256, (const guchar *)contents, length));
+    g_free(contents);
+}
+
+static void clear_apt_sources(AptSources *sources) {
+    if (sources->digests) g_hash_table_unref(sources->digests);
+    if (sources->stale) g_ptr_array_free(sources->stale, TRUE);
+    sources->digests = NULL;
+    sources->stale = NULL;
+}
+
+// Install step verify: nothing to fetch
+static gboolean package_lists_fresh(const gchar *arg G_GNUC_UNUSED) {
+    AptSources sources;
+    scan_apt_sources(&sources);
+    gboolean fresh = sources.digests && g_hash_table_size(sources.digests) > 0 && sources.stale->len == 0;
+    clear_apt_sources(&sources);
+    return fresh;
+}
+
+// Refresh only the stale source when it is the only one, such as a repository just added;
+// the indexes of the other sources are kept rather than cleaned up
+static gchar *apt_update_command(const AptSources *sources) {
+    if (sources->stale->len != 1 || g_hash_table_size(sources->digests) < 2) return g_strdup("apt-get update");
+    
+    return g_strdup_printf("apt-get update -o Dir::Etc::sourcelist=%s -o Dir::Etc::sourceparts=- "
+                           "-o APT::Get::List-Cleanup=0", (const gchar *)g_ptr_array_index(sources->stale, 0));
+}
+
+// Remember what was fetched: every source after a full update, the stale ones otherwise
+static void record_apt_update(const AptSources *sources, gboolean all_sources) {
+    GKeyFile *state = g_key_file_new();
+    gchar *path = apt_sources_state_path();
+    g_key_file_load_from_file(state, path, G_KEY_FILE_NONE, NULL);
+    gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+    
+    GHashTableIter iter;
+    gpointer source, digest;
+    g_hash_table_iter_init(&iter, sources->digests);
+    while (g_hash_table_iter_next(&iter, &source, &digest)) {
+        gboolean fetched = all_sources;
+        for (guint i = 0; !fetched && i < sources->stale->len; i++) {
+            fetched = strcmp(g_ptr_array_index(sources->stale, i), source) == 0;
+        }
+        if (!fetched) continue;
+        g_key_file_set_string(state, "digests", source, digest);
+        g_key_file_set_int64(state, "fetched", source, now);
+    }
+    
+    gchar *directory = g_path_get_dirname(path);
+    if (g_mkdir_with_parents(directory, 0700) != 0 || !g_key_file_save_to_file(state, path, NULL)) {
+        fprintf(stderr, "Cannot save %s\n", path);
+    }
+    g_free(directory);
+    g_free(path);
+    g_key_file_free(state);
+}
+
+static gchar *apt_sources_state_path(void) {
+    return app_state_path(APT_SOURCES_STATE_FILE);
+}
+
+// Parse os-release KEY=VALUE lines, unquoting shell-style values
+static GHashTable *parse_os_release(const gchar *contents) {
+    GHashTable *fields = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    
+    for (gint i = 0; lines[i]; i++) {
+        gchar *line = g_strstrip(lines[i]);
+        gchar *equals = strchr(line, '=');
+        if (line[0] == '#' || !equals || equals == line) continue;
+        
+        *equals = '\0';
+        const gchar *raw = equals + 1;
+        GString *value = g_string_new(NULL);
+        gchar quote = (*raw == '"' || *raw == '\'') ? *raw++ : '\0';
+        
+        for (; *raw && *raw != quote; raw++) {
+            if (*raw == '\\' && quote != '\'' && raw[1]) raw++;
+            g_string_append_c(value, *raw);
+        }
+        
+        g_hash_table_replace(fields, g_strdup(line), g_string_free(value, FALSE));
+    }
+    
+    g_strfreev(lines);
+    return fields;
+}
+
+// Directory name of NVIDIA's CUDA repository for this distribution
+static gchar *build_nvidia_repo_id(const SystemInfo *info) {
+    static const struct {
+        const gchar *codename;
+        const gchar *repo_id;
+    } known_codenames[] = {
+        { "focal", "ubuntu2004" },
+        { "jammy", "ubuntu2204" },
+        { "noble", "ubuntu2404" },
+        { "bullseye", "debian11" },
+        { "bookworm", "debian12" },
+    };
+    
+    if (info->os_version_id && g_strcmp0(info->os_id, "ubuntu") == 0) {
+        gchar **parts = g_strsplit(info->os_version_id, ".", 2);
+        gchar *repo_id = g_strdup_printf("ubuntu%s%s", parts[0], parts[1] ? parts[1] : "");
+        g_strfreev(parts);
+        return repo_id;
+    }
+    if (info->os_version_id && g_strcmp0(info->os_id, "debian") == 0) {
+        return g_strdup_printf("debian%.*s", (gint)strcspn(info->os_version_id, "."), info->os_version_id);
+    }
+    
+    // Derivatives such as Linux Mint or Pop!_OS map through their upstream codename
+    for (gsize i = 0; i < G_N_ELEMENTS(known_codenames); i++) {
+        if (g_strcmp0(info->upstream_codename, known_codenames[i].codename) == 0) {
+            return g_strdup(known_codenames[i].repo_id);
+        }
+    }
+    return NULL;
+}
+
+// Detect the distribution from os-release without running lsb_release
+static gboolean detect_distro(SystemInfo *info) {
+    gchar *contents = NULL;
+    
+    g_free(info->os_id);
+    g_free(info->os_version_id);
+    g_free(info->os_id_like);
+    g_free(info->distro_codename);
+    g_free(info->upstream_codename);
+    g_free(info->nvidia_repo_id);
+    info->os_id = NULL;
+    info->os_version_id = NULL;
+    info->os_id_like = NULL;
+    info->upstream_codename = NULL;
+    info->nvidia_repo_id = NULL;
+    
+    if (!g_file_get_contents(OS_RELEASE_PATH, &contents, NULL, NULL) &&
+        !g_file_get_contents(OS_RELEASE_FALLBACK_PATH, &contents, NULL, NULL)) {
+        info->distro_codename = g_strdup("unknown");
+        return FALSE;
+    }
+    
+    GHashTable *fields = parse_os_release(contents);
+    g_free(contents);
+    
+    const gchar *codename = g_hash_table_lookup(fields, "VERSION_CODENAME");
+    const gchar *upstream = g_hash_table_lookup(fields, "UBUNTU_CODENAME");
+    if (!upstream) upstream = g_hash_table_lookup(fields, "DEBIAN_CODENAME");
+    if (!upstream) upstream = codename;
+    
+    info->os_id = g_strdup(g_hash_table_lookup(fields, "ID"));
+    info->os_version_id = g_strdup(g_hash_table_lookup(fields, "VERSION_ID"));
+    info->os_id_like = g_strdup(g_hash_table_lookup(fields, "ID_LIKE"));
+    info->distro_codename = g_strdup(codename ? codename : "unknown");
+    info->upstream_codename = g_strdup(upstream);
+    info->nvidia_repo_id = build_nvidia_repo_id(info);
+    
+    g_hash_table_destroy(fields);
+    return info->os_id != NULL;
+}
+
+// Read a small sysfs attribute into buffer with trailing whitespace stripped
+static gboolean read_sysfs_attr(const gchar *dir, const gchar *attr, gchar *buffer, gsize size) {
+    gchar path[PATH_MAX];
+    g_snprintf(path, sizeof(path), "%s/%s", dir, attr);
+    
+    gint fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return FALSE;
+    
+    ssize_t len = read(fd, buffer, size - 1);
+    close(fd);
+    if (len <= 0) return FALSE;
+    
+    buffer[len] = '\0';
+    g_strchomp(buffer);
+    return TRUE;
+}
+
+static void clear_gpu_device(gpointer data) {
+    GpuDevice *gpu = (GpuDevice *)data;
+    g_free(gpu->model_name);
+}
+
+// Walk /sys/bus/pci/devices and collect NVIDIA display and 3D controllers
+static GArray *scan_nvidia_pci_devices(void) {
+    GArray *gpus = g_array_new(FALSE, TRUE, sizeof(GpuDevice));
+    g_array_set_clear_func(gpus, clear_gpu_device);
+    
+    DIR *dir = opendir(SYSFS_PCI_DEVICES_DIR);
+    if (!dir) return gpus;
+    
+    struct dirent *entry;
+    gchar value[64];
+    gchar device_dir[PATH_MAX];
+    
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        g_snprintf(device_dir, sizeof(device_dir), "%s/%s", SYSFS_PCI_DEVICES_DIR, entry->d_name);
+        
+        if (!read_sysfs_attr(device_dir, "vendor", value, sizeof(value)) ||
+            g_ascii_strtoull(value, NULL, 16) != NVIDIA_PCI_VENDOR_ID) {
+            continue;
+        }
+        if (!read_sysfs_attr(device_dir, "class", value, sizeof(value))) continue;
+        guint32 class_code = (guint32)g_ascii_strtoull(value, NULL, 16);
+        if ((class_code >> 16) != PCI_BASE_CLASS_DISPLAY) continue;  // Skips the HDMI audio and USB-C functions
+        
+        GpuDevice gpu = { 0 };
+        g_strlcpy(gpu.bdf, entry->d_name, sizeof(gpu.bdf));
+        gpu.class_code = class_code;
+        gpu.numa_node = -1;
+        gpu.iommu_group = -1;
+        
+        if (read_sysfs_attr(device_dir, "device", value, sizeof(value))) {
+            gpu.device_id = (guint16)g_ascii_strtoull(value, NULL, 16);
+        }
+        if (read_sysfs_attr(device_dir, "subsystem_vendor", value, sizeof(value))) {
+            gpu.subsys_vendor_id = (guint16)g_ascii_strtoull(value, NULL, 16);
+        }
+        if (read_sysfs_attr(device_dir, "subsystem_device", value, sizeof(value))) {
+            gpu.subsys_device_id = (guint16)g_ascii_strtoull(value, NULL, 16);
+        }
+        if (read_sysfs_attr(device_dir, "numa_node", value, sizeof(value))) {
+            gpu.numa_node = (gint)g_ascii_strtoll(value, NULL, 10);
+        }
+        
+        gchar link_path[PATH_MAX];
+        gchar link_target[PATH_MAX];
+        g_snprintf(link_path, sizeof(link_path), "%s/iommu_group", device_dir);
+        ssize_t link_len = readlink(link_path, link_target, sizeof(link_target) - 1);
+        if (link_len > 0) {
+            link_target[link_len] = '\0';
+            const gchar *group = strrchr(link_target, '/');
+            gpu.iommu_group = (gint)g_ascii_strtoll(group ? group + 1 : link_target, NULL, 10);
+        }
+        
+        gpu.model_name = lookup_pci_device_name(NVIDIA_PCI_VENDOR_ID, gpu.device_id);
+        g_array_append_val(gpus, gpu);
+    }
+    closedir(dir);
+    
+    return gpus;
+}
+
+// pci.ids is mapped on first use and kept for the lifetime of the process
+static GMappedFile *pci_ids_file = NULL;
+static const gchar *pci_ids_vendor_start = NULL;
+static const gchar *pci_ids_vendor_end = NULL;
+static pthread_once_t pci_ids_once = PTHREAD_ONCE_INIT;
+
+static void load_pci_ids(void) {
+    static const gchar *const pci_ids_paths[] = {
+        "/usr/share/misc/pci.ids",
+        "/usr/share/hwdata/pci.ids",
+        "/usr/share/pci.ids",
+    };
+    
+    for (gsize i = 0; i < G_N_ELEMENTS(pci_ids_paths) && !pci_ids_file; i++) {
+        pci_ids_file = g_mapped_file_new(pci_ids_paths[i], FALSE, NULL);
+    }
+    if (!pci_ids_file) return;
+    
+    const gchar *contents = g_mapped_file_get_contents(pci_ids_file);
+    gsize length = g_mapped_file_get_length(pci_ids_file);
+    if (!contents || length == 0) return;
+    
+    // Remember where the NVIDIA block starts and ends so lookups never rescan the file
+    const gchar *vendor = memmem(contents, length, "\n10de  ", 7);
+    if (!vendor) return;
+    
+    const gchar *end = contents + length;
+    const gchar *line = memchr(vendor + 1, '\n', end - vendor - 1);
+    while (line && line + 1 < end) {
+        line++;
+        if (*line != '\t' && *line != '#' && *line != '\n') break;
+        line = memchr(line, '\n', end - line);
+    }
+    
+    pci_ids_vendor_start = vendor + 1;
+    pci_ids_vendor_end = line ? line : end;
+}
+
+// Look up a device name in pci.ids, falling back to the raw IDs
+static gchar *lookup_pci_device_name(guint16 vendor_id, guint16 device_id) {
+    pthread_once(&pci_ids_once, load_pci_ids);
+    
+    if (vendor_id == NVIDIA_PCI_VENDOR_ID && pci_ids_vendor_start) {
+        gchar key[8];
+        g_snprintf(key, sizeof(key), "\t%04x  ", device_id);
+        
+        const gchar *line = pci_ids_vendor_start;
+        while (line < pci_ids_vendor_end) {
+            const gchar *eol = memchr(line, '\n', pci_ids_vendor_end - line);
+            if (!eol) eol = pci_ids_vendor_end;
+            
+            if (eol - line > 7 && memcmp(line, key, 7) == 0) {
+                return g_strdup_printf("NVIDIA %.*s", (gint)(eol - line - 7), line + 7);
+            }
+            line = eol + 1;
+        }
+    }
+    
+    return g_strdup_printf("NVIDIA device %04x:%04x", vendor_id, device_id);
+}
+
+// Detect NVIDIA GPUs from sysfs without spawning lspci
+static gboolean detect_nvidia_gpu(SystemInfo *info) {
+    GArray *gpus = scan_nvidia_pci_devices();
+    
+    if (info->gpus) g_array_unref(info->gpus);
+    info->gpus = gpus;
+    g_free(info->gpu_info);
+    
+    if (gpus->len == 0) {
+        info->gpu_detected = FALSE;
+        info->gpu_info = g_strdup("No NVIDIA GPU detected");
+        return FALSE;
+    }
+    
+    info->gpu_detected = TRUE;
+    if (gpus->len == 1) {
+        GpuDevice *gpu = &g_array_index(gpus, GpuDevice, 0);
+        info->gpu_info = g_strdup_printf("Detected: %s (%s)", gpu->model_name, gpu->bdf);
+        return TRUE;
+    }
+    
+    // Group identical boards so an 8-GPU node reads as "8x <model>"
+    GString *summary = g_string_new(NULL);
+    g_string_append_printf(summary, "Detected %u GPUs:", gpus->len);
+    for (guint i = 0; i < gpus->len; i++) {
+        const gchar *model = g_array_index(gpus, GpuDevice, i).model_name;
+        gboolean seen = FALSE;
+        guint count = 0;
+        
+        for (guint j = 0; j < gpus->len; j++) {
+            if (g_strcmp0(g_array_index(gpus, GpuDevice, j).model_name, model) == 0) {
+                if (j < i) seen = TRUE;
+                count++;
+            }
+        }
+        if (!seen) {
+            g_string_append_printf(summary, " %ux %s,", count, model);
+        }
+    }
+    g_string_truncate(summary, summary->len - 1);
+    info->gpu_info = g_string_free(summary, FALSE);
+    return TRUE;
+}
+
+// Check for a dotted numeric version such as 550.54.14
+static gboolean is_version_token(const gchar *token) {
+    gboolean seen_dot = FALSE;
+    
+    if (!g_ascii_isdigit(*token)) return FALSE;
+    for (const gchar *c = token; *c; c++) {
+        if (*c == '.') {
+            if (!g_ascii_isdigit(c[1])) return FALSE;
+            seen_dot = TRUE;
+        } else if (!g_ascii_isdigit(*c)) {
+            return FALSE;
+        }
+    }
+    return seen_dot;
+}
+
+// Version of the loaded kernel module from procfs, or sysfs when procfs is missing
+static gchar *read_kernel_driver_version(void) {
+    gchar buffer[512];
+    
+    if (read_sysfs_attr(PROC_NVIDIA_DRIVER_DIR, "version", buffer, sizeof(buffer))) {
+        // "NVRM version: NVIDIA UNIX x86_64 Kernel Module  550.54.14  Thu Feb 22 ..."
+        gchar *eol = strchr(buffer, '\n');
+        if (eol) *eol = '\0';
+        
+        gchar **tokens = g_strsplit_set(buffer, " \t", -1);
+        gchar *version = NULL;
+        for (gint i = 0; tokens[i] && !version; i++) {
+            if (is_version_token(tokens[i])) {
+                version = g_strdup(tokens[i]);
+            }
+        }
+        g_strfreev(tokens);
+        if (version) return version;
+    }
+    
+    if (read_sysfs_attr(SYSFS_NVIDIA_MODULE_DIR, "version", buffer, sizeof(buffer)) &&
+        is_version_token(buffer)) {
+        return g_strdup(buffer);
+    }
+    
+    return NULL;
+}
+
+// Version of the installed userspace driver, taken from the libnvidia-ml.so.1 symlink
+static gchar *read_userspace_driver_version(void) {
+    static const gchar *const lib_dirs[] = {
+        "/usr/lib/x86_64-linux-gnu",
+        "/usr/lib/aarch64-linux-gnu",
+        "/usr/lib64",
+        "/usr/lib",
+    };
+    const gchar *prefix = "libnvidia-ml.so.";
+    
+    for (gsize i = 0; i < G_N_ELEMENTS(lib_dirs); i++) {
+        gchar link_path[PATH_MAX];
+        gchar target[PATH_MAX];
+        g_snprintf(link_path, sizeof(link_path), "%s/libnvidia-ml.so.1", lib_dirs[i]);
+        
+        ssize_t len = readlink(link_path, target, sizeof(target) - 1);
+        if (len <= 0) continue;
+        target[len] = '\0';
+        
+        const gchar *name = strrchr(target, '/');
+        name = name ? name + 1 : target;
+        if (g_str_has_prefix(name, prefix) && is_version_token(name + strlen(prefix))) {
+            return g_strdup(name + strlen(prefix));
+        }
+    }
+    
+    return NULL;
+}
+
+// Detect NVIDIA driver installation, using nvidia-smi only when procfs and sysfs have nothing
+static gboolean detect_nvidia_driver(SystemInfo *info) {
+    g_free(info->driver_info);
+    g_free(info->driver_kernel_version);
+    g_free(info->driver_userspace_version);
+    info->driver_kernel_version = read_kernel_driver_version();
+    info->driver_userspace_version = read_userspace_driver_version();
+    info->driver_version_mismatch = FALSE;
+    
+    const gchar *kernel = info->driver_kernel_version;
+    const gchar *userspace = info->driver_userspace_version;
+    
+    if (kernel && userspace && strcmp(kernel, userspace) != 0) {
+        info->driver_installed = TRUE;
+        info->driver_version_mismatch = TRUE;
+        info->driver_info = g_strdup_printf("Version mismatch: kernel module %s, userspace %s (reboot required)",
+                                            kernel, userspace);
+        return TRUE;
+    }
+    if (kernel) {
+        info->driver_installed = TRUE;
+        info->driver_info = g_strdup_printf("Installed: Version %s", kernel);
+        return TRUE;
+    }
+    if (userspace) {
+        // Freshly installed but not loaded yet, the usual state before the first reboot
+        info->driver_installed = TRUE;
+        info->driver_version_mismatch = TRUE;
+        info->driver_info = g_strdup_printf("Installed: Version %s (kernel module not loaded)", userspace);
+        return TRUE;
+    }
+    
+    gchar *output = NULL;
+    gint result = run_command("nvidia-smi --query-gpu=driver_version --format=csv,noheader,nounits", &output);
+    
+    if (result == 0 && output != NULL && strlen(output) > 0) {
+        // One line per GPU, all of them report the same version
+        gchar *eol = strchr(output, '\n');
+        if (eol) *eol = '\0';
+        g_strstrip(output);
+        
+        info->driver_installed = TRUE;
+        info->driver_userspace_version = g_strdup(output);
+        info->driver_info = g_strdup_printf("Installed: Version %s", output);
+        g_free(output);
+        return TRUE;
+    }
+    
+    info->driver_installed = FALSE;
+    info->driver_info = g_strdup("Not installed");
+    if (output) g_free(output);
+    return FALSE;
+}
+
+// Compare dotted numeric versions, returns <0, 0 or >0 like strcmp
+static gint compare_versions(const gchar *a, const gchar *b) {
+    while (*a || *b) {
+        gchar *a_end, *b_end;
+        guint64 a_part = g_ascii_strtoull(a, &a_end, 10);
+        guint64 b_part = g_ascii_strtoull(b, &b_end, 10);
+        
+        if (a_part != b_part) return a_part < b_part ? -1 : 1;
+        if (a_end == a && b_end == b) return strcmp(a, b);  // Non-numeric tails
+        
+        a = (*a_end == '.') ? a_end + 1 : a_end;
+        b = (*b_end == '.') ? b_end + 1 : b_end;
+    }
+    return 0;
+}
+
+static gint compare_cuda_toolkits(gconstpointer a, gconstpointer b) {
+    return compare_versions(((const CudaToolkit *)b)->version, ((const CudaToolkit *)a)->version);
+}
+
+static void clear_cuda_toolkit(gpointer data) {
+    CudaToolkit *toolkit = (CudaToolkit *)data;
+    g_free(toolkit->path);
+    g_free(toolkit->version);
+    g_strfreev(toolkit->components);
+}
+
+// Read a JSON string literal starting at the opening quote, advancing the cursor past it
+static gchar *read_json_string(const gchar **cursor) {
+    const gchar *c = *cursor + 1;
+    GString *value = g_string_new(NULL);
+    
+    while (*c && *c != '"') {
+        if (*c == '\\' && c[1]) c++;
+        g_string_append_c(value, *c++);
+    }
+    *cursor = *c ? c + 1 : c;
+    return g_string_free(value, FALSE);
+}
+
+// Pull the SDK version and per-component versions out of version.json:
+// { "cuda" : { "name" : "CUDA SDK", "version" : "12.6.2" }, "cuda_nvcc" : { ... }, ... }
+static gboolean parse_cuda_version_json(const gchar *contents, gchar **version, gchar ***components) {
+    GPtrArray *pairs = g_ptr_array_new();
+    gchar *component = NULL;
+    gchar *last_key = NULL;
+    gint depth = 0;
+    
+    *version = NULL;
+    for (const gchar *c = contents; *c; ) {
+        if (*c == '{') {
+            depth++;
+            c++;
+        } else if (*c == '}') {
+            depth--;
+            c++;
+        } else if (*c == '"') {
+            gchar *text = read_json_string(&c);
+            while (g_ascii_isspace(*c)) c++;
+            
+            if (*c == ':') {
+                g_free(last_key);
+                last_key = text;
+                if (depth == 1) {
+                    g_free(component);
+                    component = g_strdup(text);
+                }
+            } else {
+                if (depth == 2 && component && g_strcmp0(last_key, "version") == 0) {
+                    if (strcmp(component, "cuda") == 0) {
+                        g_free(*version);
+                        *version = g_strdup(text);
+                    } else {
+                        g_ptr_array_add(pairs, g_strdup_printf("%s %s", component, text));
+                    }
+                }
+                g_free(text);
+            }
+        } else {
+            c++;
+        }
+    }
+    g_free(component);
+    g_free(last_key);
+    
+    g_ptr_array_add(pairs, NULL);
+    *components = (gchar **)g_ptr_array_free(pairs, FALSE);
+    return *version != NULL;
+}
+
+// Version of a single component such as "cuda_nvcc", NULL if unknown
+static const gchar *find_cuda_component(const CudaToolkit *toolkit, const gchar *name) {
+    gsize name_len = strlen(name);
+    
+    for (gchar **pair = toolkit->components; pair && *pair; pair++) {
+        if (strncmp(*pair, name, name_len) == 0 && (*pair)[name_len] == ' ') {
+            return *pair + name_len + 1;
+        }
+    }
+    return NULL;
+}
+
+// Record the toolkit under path if it has version metadata and was not seen before
+static void add_cuda_toolkit(GArray *toolkits, GHashTable *seen, const gchar *path, gboolean is_default) {
+    gchar *real_path = realpath(path, NULL);
+    if (!real_path) return;
+    
+    if (g_hash_table_contains(seen, real_path)) {
+        if (is_default) {
+            for (guint i = 0; i < toolkits->len; i++) {
+                CudaToolkit *toolkit = &g_array_index(toolkits, CudaToolkit, i);
+                if (strcmp(toolkit->path, real_path) == 0) toolkit->is_default = TRUE;
+            }
+        }
+        free(real_path);
+        return;
+    }
+    
+    CudaToolkit toolkit = { 0 };
+    gchar *contents = NULL;
+    gchar *version_file = g_build_filename(real_path, "version.json", NULL);
+    
+    if (g_file_get_contents(version_file, &contents, NULL, NULL)) {
+        parse_cuda_version_json(contents, &toolkit.version, &toolkit.components);
+    } else {
+        g_free(version_file);
+        version_file = g_build_filename(real_path, "version.txt", NULL);
+        
+        // "CUDA Version 11.2.152"
+        if (g_file_get_contents(version_file, &contents, NULL, NULL)) {
+            const gchar *marker = strstr(contents, "Version ");
+            if (marker) {
+                toolkit.version = g_strdup(marker + strlen("Version "));
+                g_strstrip(toolkit.version);
+            }
+        }
+    }
+    g_free(version_file);
+    g_free(contents);
+    
+    if (toolkit.version) {
+        toolkit.path = g_strdup(real_path);
+        toolkit.is_default = is_default;
+        g_array_append_val(toolkits, toolkit);
+        g_hash_table_add(seen, g_strdup(real_path));
+    } else {
+        g_strfreev(toolkit.components);
+    }
+    free(real_path);
+}
+
+// Check every entry of dir whose name starts with name_prefix, descending up to depth levels
+static void scan_cuda_prefix_dir(GArray *toolkits, GHashTable *seen, const gchar *dir,
+                                 const gchar *name_prefix, gint depth) {
+    GDir *handle = g_dir_open(dir, 0, NULL);
+    if (!handle) return;
+    
+    const gchar *name;
+    while ((name = g_dir_read_name(handle)) != NULL) {
+        if (!g_str_has_prefix(name, name_prefix)) continue;
+        
+        gchar *path = g_build_filename(dir, name, NULL);
+        if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
+            guint before = toolkits->len;
+            add_cuda_toolkit(toolkits, seen, path, FALSE);
+            
+            // HPC SDK layout: /opt/nvidia/hpc_sdk/Linux_x86_64/24.7/cuda/12.5
+            if (toolkits->len == before && depth > 1) {
+                scan_cuda_prefix_dir(toolkits, seen, path, "", depth - 1);
+            }
+        }
+        g_free(path);
+    }
+    g_dir_close(handle);
+}
+
+// Enumerate every installed CUDA toolkit without relying on nvcc or PATH
+static GArray *scan_cuda_toolkits(void) {
+    GArray *toolkits = g_array_new(FALSE, TRUE, sizeof(CudaToolkit));
+    g_array_set_clear_func(toolkits, clear_cuda_toolkit);
+    GHashTable *seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    
+    add_cuda_toolkit(toolkits, seen, CUDA_DEFAULT_PREFIX, TRUE);
+    add_cuda_toolkit(toolkits, seen, "/etc/alternatives/cuda", FALSE);
+    scan_cuda_prefix_dir(toolkits, seen, "/etc/alternatives", "cuda-", 1);
+    scan_cuda_prefix_dir(toolkits, seen, "/usr/local", "cuda-", 1);
+    scan_cuda_prefix_dir(toolkits, seen, "/opt/nvidia", "", CUDA_OPT_SEARCH_DEPTH);
+    
+    g_hash_table_destroy(seen);
+    g_array_sort(toolkits, compare_cuda_toolkits);
+    return toolkits;
+}
+
+// Detect installed CUDA toolkits
+static gboolean detect_cuda(SystemInfo *info) {
+    GArray *toolkits = scan_cuda_toolkits();
+    
+    if (info->cuda_toolkits) g_array_unref(info->cuda_toolkits);
+    info->cuda_toolkits = toolkits;
+    g_free(info->cuda_info);
+    
+    if (toolkits->len == 0) {
+        info->cuda_installed = FALSE;
+        info->cuda_info = g_strdup("Not installed");
+        return FALSE;
+    }
+    
+    GString *summary = g_string_new("Installed: CUDA");
+    for (guint i = 0; i < toolkits->len; i++) {
+        CudaToolkit *toolkit = &g_array_index(toolkits, CudaToolkit, i);
+        g_string_append_printf(summary, "%s %s%s", i > 0 ? "," : "", toolkit->version,
+                               (toolkit->is_default && toolkits->len > 1) ? " (default)" : "");
+    }
+    
+    info->cuda_installed = TRUE;
+    info->cuda_info = g_string_free(summary, FALSE);
+    return TRUE;
+}
+
+static HostFacts host_facts;
+static pthread_once_t host_facts_once = PTHREAD_ONCE_INIT;
+
+static void load_host_facts(void) {
+    gchar buffer[1024];
+    
+    if (uname(&host_facts.uts) != 0) {
+        memset(&host_facts.uts, 0, sizeof(host_facts.uts));
+    }
+    
+    host_facts.kernel_release = read_sysfs_attr("/proc/sys/kernel", "osrelease", buffer, sizeof(buffer))
+                                ? g_strdup(buffer) : g_strdup(host_facts.uts.release);
+    host_facts.proc_version = read_sysfs_attr("/proc", "version", buffer, sizeof(buffer))
+                              ? g_strdup(buffer) : g_strdup(host_facts.uts.version);
+    
+    gchar *version_lower = g_ascii_strdown(host_facts.proc_version, -1);
+    gchar *release_lower = g_ascii_strdown(host_facts.kernel_release, -1);
+    host_facts.is_wsl = strstr(version_lower, "microsoft") != NULL ||
+                        strstr(release_lower, "microsoft") != NULL ||
+                        strstr(release_lower, "wsl") != NULL;
+    g_free(version_lower);
+    g_free(release_lower);
+    
+    if (strcmp(host_facts.uts.machine, "x86_64") == 0) {
+        host_facts.cuda_repo_arch = "x86_64";
+    } else if (strcmp(host_facts.uts.machine, "aarch64") == 0) {
+        host_facts.cuda_repo_arch = "sbsa";
+    } else {
+        host_facts.cuda_repo_arch = NULL;
+    }
+}
+
+// Host facts are probed once per process, later calls are a memory lookup
+static const HostFacts *get_host_facts(void) {
+    pthread_once(&host_facts_once, load_host_facts);
+    return &host_facts;
+}
+
+// Check if running in WSL
+static gboolean is_wsl_system(void) {
+    return get_host_facts()->is_wsl;
+}
+
+// Check internet connectivity
+static gboolean check_internet_connectivity(AppData *data) {
+    gint result = run_command("ping -c 1 8.8.8.8", NULL);
+    if (result != 0) {
+        post_log_message(data, STATUS_ERROR, "No internet connection detected. Installation requires internet access.");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// Everything the install writes, grouped by the directory it lands in
+static const DiskRequirement disk_requirements[] = {
+    { "/var/cache/apt/archives", 300 * MIB, 800 * MIB, 4 * GIB },   // Downloaded .deb files
+    { "/var/lib",                200 * MIB, 300 * MIB, 0 },         // apt lists and DKMS builds
+    { "/usr",                    600 * MIB, 1 * GIB,   512 * MIB }, // Build tools, driver libraries, module sources
+    { "/usr/local",              0,         0,         7 * GIB },   // CUDA toolkit
+    { "/boot",                   0,         200 * MIB, 0 },         // Regenerated initramfs
+};
+
+// Walk up from path to the root of the filesystem it lives on
+static gchar *find_mount_point(const gchar *path, dev_t device) {
+    gchar *current = g_strdup(path);
+    
+    while (strcmp(current, "/") != 0) {
+        gchar *parent = g_path_get_dirname(current);
+        struct stat st;
+        if (stat(parent, &st) != 0 || st.st_dev != device) {
+            g_free(parent);
+            break;
+        }
+        g_free(current);
+        current = parent;
+    }
+    return current;
+}
+
+// Check free space on every filesystem the install writes to before anything is downloaded
+static gboolean check_disk_space(AppData *data, gboolean install_driver, gboolean install_cuda) {
+    typedef struct {
+        dev_t device;
+        gchar *mount_point;
+        guint64 required;
+        guint64 available;
+    } MountUsage;
+    
+    MountUsage mounts[G_N_ELEMENTS(disk_requirements)];
+    guint mount_count = 0;
+    gboolean enough = TRUE;
+    
+    for (gsize i = 0; i < G_N_ELEMENTS(disk_requirements); i++) {
+        const DiskRequirement *req = &disk_requirements[i];
+        guint64 required = req->base_bytes +
+                           (install_driver ? req->driver_bytes : 0) +
+                           (install_cuda ? req->cuda_bytes : 0);
+        if (required == 0) continue;
+        
+        // Directories that do not exist yet (e.g. /usr/local/cuda-*) land on their closest parent
+        gchar *path = g_strdup(req->path);
+        struct stat st;
+        while (stat(path, &st) != 0 && strcmp(path, "/") != 0) {
+            gchar *parent = g_path_get_dirname(path);
+            g_free(path);
+            path = parent;
+        }
+        
+        struct statvfs vfs;
+        if (stat(path, &st) != 0 || statvfs(path, &vfs) != 0) {
+            post_log_message(data, STATUS_WARNING, "Unable to check free space for %s: %s",
+                             req->path, g_strerror(errno));
+            g_free(path);
+            continue;
+        }
+        
+        // Paths on the same filesystem share its free space
+        guint m = 0;
+        while (m < mount_count && mounts[m].device != st.st_dev) m++;
+        if (m == mount_count) {
+            mounts[m].device = st.st_dev;
+            mounts[m].mount_point = find_mount_point(path, st.st_dev);
+            mounts[m].required = 0;
+            mounts[m].available = (guint64)vfs.f_bavail * vfs.f_frsize;
+            mount_count++;
+        }
+        mounts[m].required += required;
+        g_free(path);
+    }
+    
+    for (guint m = 0; m < mount_count; m++) {
+        gchar *required = g_format_size(mounts[m].required);
+        gchar *available = g_format_size(mounts[m].available);
+        
+        if (mounts[m].available < mounts[m].required) {
+            post_log_message(data, STATUS_ERROR, "Not enough space on %s: %s needed, %s free",
+                             mounts[m].mount_point, required, available);
+            enough = FALSE;
+        } else {
+            post_log_message(data, STATUS_INFO, "Disk space on %s: %s needed, %s free",
+                             mounts[m].mount_point, required, available);
+        }
+        
+        g_free(required);
+        g_free(available);
+        g_free(mounts[m].mount_point);
+    }
+    
+    if (!enough) {
+        post_log_message(data, STATUS_ERROR, "Free up disk space and try again. Nothing has been downloaded yet.");
+    }
+    return enough;
+}
+
+// Read the one-byte value of an EFI global variable, -1 if it is missing
+static gint read_efi_variable_byte(const gchar *efi_dir, const gchar *name) {
+    gchar path[PATH_MAX];
+    guint8 buffer[8];
+    
+    // efivarfs prefixes the value with a 4-byte attribute word
+    g_snprintf(path, sizeof(path), "%s/efivars/%s-%s", efi_dir, name, EFI_GLOBAL_VARIABLE_GUID);
+    gint fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        ssize_t len = read(fd, buffer, sizeof(buffer));
+        close(fd);
+        if (len >= 5) return buffer[4];
+    }
+    
+    // Older kernels expose the raw value through the sysfs vars interface
+    g_snprintf(path, sizeof(path), "%s/vars/%s-%s/data", efi_dir, name, EFI_GLOBAL_VARIABLE_GUID);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        ssize_t len = read(fd, buffer, sizeof(buffer));
+        close(fd);
+        if (len >= 1) return buffer[0];
+    }
+    
+    return -1;
+}
+
+// Determine Secure Boot state from efivars without mokutil
+static SecureBootState read_secure_boot_state(const gchar *efi_dir) {
+    if (!g_file_test(efi_dir, G_FILE_TEST_IS_DIR)) {
+        return SECURE_BOOT_LEGACY_BIOS;
+    }
+    
+    gint secure_boot = read_efi_variable_byte(efi_dir, "SecureBoot");
+    if (secure_boot < 0) return SECURE_BOOT_UNKNOWN;
+    if (secure_boot == 0) return SECURE_BOOT_DISABLED;
+    
+    return read_efi_variable_byte(efi_dir, "SetupMode") == 1 ? SECURE_BOOT_SETUP_MODE : SECURE_BOOT_ENABLED;
+}
+
+// Check system compatibility before installation
+static gboolean check_system_compatibility(AppData *data, gboolean install_driver, gboolean install_cuda) {
+    if (is_wsl_system()) {
+        post_log_message(data, STATUS_ERROR, "ERROR: Running in WSL. NVIDIA driver installation requires native Linux.");
+        post_log_message(data, STATUS_INFO, "This tool is designed for live boot Linux systems or native installations.");
+        post_log_message(data, STATUS_INFO, "To use this tool:");
+        post_log_message(data, STATUS_INFO, "1. Create a live USB with Ubuntu/Debian");
+        post_log_message(data, STATUS_INFO, "2. Boot from the USB on the target system");
+        post_log_message(data, STATUS_INFO, "3. Run this tool on the live system");
+        return FALSE;
+    }
+    
+    if (getuid() == 0) {
+        post_log_message(data, STATUS_WARNING, "WARNING: Running as root. This is not recommended for security reasons.");
+    }
+    
+    if (!check_disk_space(data, install_driver, install_cuda)) {
+        return FALSE;
+    }
+    
+    // Check Secure Boot
+    const gchar *efi_dir = g_getenv(EFI_FIRMWARE_DIR_ENV);
+    switch (read_secure_boot_state(efi_dir ? efi_dir : EFI_FIRMWARE_DIR)) {
+        case SECURE_BOOT_ENABLED:
+            post_log_message(data, STATUS_WARNING, "WARNING: Secure Boot is enabled. Driver installation may require additional steps.");
+            break;
+        case SECURE_BOOT_SETUP_MODE:
+            post_log_message(data, STATUS_INFO, "Secure Boot is in setup mode and not enforcing signatures.");
+            break;
+        case SECURE_BOOT_LEGACY_BIOS:
+            post_log_message(data, STATUS_INFO, "Legacy BIOS boot detected, Secure Boot does not apply.");
+            break;
+        case SECURE_BOOT_UNKNOWN:
+            post_log_message(data, STATUS_INFO, "Unable to read Secure Boot state from EFI variables.");
+            break;
+        default:
+            break;
+    }
+    
+    // Check distro compatibility
+    if (data->system_info.upstream_codename) {
+        if (g_strcmp0(data->system_info.upstream_codename, "bullseye") == 0) {
+            post_log_message(data, STATUS_WARNING, "WARNING: Debian 11 is EOL. Upgrade recommended.");
+        } else if (g_strcmp0(data->system_info.upstream_codename, "bookworm") != 0 &&
+                   g_strcmp0(data->system_info.upstream_codename, "jammy") != 0 &&
+                   g_strcmp0(data->system_info.upstream_codename, "noble") != 0) {
+            post_log_message(data, STATUS_WARNING, "WARNING: Unsupported distro. Installation may fail.");
+        }
+    }
+    
+    return TRUE;
+}
+
+// Update individual status card
+static void update_status_card(GtkWidget *icon_label, GtkWidget *status_label,
+                              const gchar *icon, const gchar *text, StatusType type) {
+    gchar *icon_markup = g_strdup_printf("<span size='large'>%s</span>", icon);
+    gtk_label_set_markup(GTK_LABEL(icon_label), icon_markup);
+    g_free(icon_markup);
+    
+    gtk_label_set_text(GTK_LABEL(status_label), text);
+    
+    GtkStyleContext *context = gtk_widget_get_style_context(status_label);
+    gtk_style_context_remove_class(context, "status-success");
+    gtk_style_context_remove_class(context, "status-warning");
+    gtk_style_context_remove_class(context, "status-error");
+    gtk_style_context_remove_class(context, "status-info");
     
     switch (type) {
         case STATUS_SUCCESS:
@@ -939,98 +4164,1331 @@ static void update_status_card(GtkWidget *icon_label, GtkWidget *status_label,
     }
 }
 
-// Log message to console with line limit
-static void log_message(AppData *data, const gchar *message, StatusType type) {
-    if (!data || !data->console_buffer) return;
-    
-    GtkTextIter iter;
-    gtk_text_buffer_get_end_iter(data->console_buffer, &iter);
+// Log message to console, main thread only
+static void log_message(AppData *data, const gchar *message, StatusType type) {
+    journal_post(data->journal, JOURNAL_RECORD_LOG, type, message);
+    append_console_line(data, message, type, g_get_real_time());
+    flush_console(data);
+}
+
+// Store one line stamped with the time it was logged; it shows up at the next flush_console
+static void append_console_line(AppData *data, const gchar *message, StatusType type, gint64 timestamp_us) {
+    if (!data) return;
+    
+    const gchar *status_icon = "";
+    switch (type) {
+        case STATUS_SUCCESS: status_icon = "[OK]"; break;
+        case STATUS_WARNING: status_icon = "[WARN]"; break;
+        case STATUS_ERROR: status_icon = "[ERROR]"; break;
+        case STATUS_INFO: status_icon = "[INFO]"; break;
+        default: status_icon = "[*]"; break;
+    }
+    
+    gchar line[CONSOLE_LINE_MAX];
+    gint length = g_snprintf(line, sizeof(line), "[%s] %s %s",
+                             console_timestamp(data, timestamp_us), status_icon, message);
+    console_store_append(&data->console_store, line, MIN((gsize)length, sizeof(line) - 1), type);
+    data->console_lines_total++;
+}
+
+// Bring the scrollbar up to date with the store and redraw once. A view that was at the
+// bottom follows new lines, one scrolled back stays on the same lines.
+static void flush_console(AppData *data) {
+    if (!data || !data->console_view) return;
+    
+    GtkAdjustment *adjustment = data->console_adjustment;
+    const ConsoleStore *store = &data->console_store;
+    guint dropped_rows = console_filter_sync(data);
+    gdouble page = console_visible_rows(data);
+    gdouble upper = data->console_filter.rows ? data->console_filter.rows->len : store->line_count;
+    gdouble value = gtk_adjustment_get_value(adjustment);
+    gboolean at_bottom = value + gtk_adjustment_get_page_size(adjustment) >= gtk_adjustment_get_upper(adjustment) - 0.5;
+    
+    if (at_bottom) {
+        value = upper - page;
+    } else {
+        value -= dropped_rows;
+    }
+    
+    gtk_adjustment_configure(adjustment, CLAMP(value, 0.0, MAX(upper - page, 0.0)), 0.0, upper,
+                             1.0, MAX(page - 1.0, 1.0), page);
+    gtk_widget_queue_draw(data->console_view);
+}
+
+// Copy a line into the newest chunk, starting a new chunk when it is full and dropping
+// the oldest once CONSOLE_MAX_CHUNKS are stored
+static void console_store_append(ConsoleStore *store, const gchar *text, gsize length, StatusType type) {
+    ConsoleChunk *chunk = store->chunks->len > 0 ? g_ptr_array_index(store->chunks, store->chunks->len - 1) : NULL;
+    
+    if (!chunk || chunk->count == CONSOLE_CHUNK_LINES) {
+        if (store->chunks->len == CONSOLE_MAX_CHUNKS) {
+            ConsoleChunk *oldest = g_ptr_array_index(store->chunks, 0);
+            g_ptr_array_remove_index(store->chunks, 0);
+            store->first_line += oldest->count;
+            store->line_count -= oldest->count;
+            g_free(oldest->text);
+            g_free(oldest);
+            
+            for (gint i = 0; i < STATUS_TYPE_COUNT; i++) {
+                GArray *lines = store->severity_lines[i];
+                guint stale = 0;
+                while (stale < lines->len && g_array_index(lines, guint64, stale) < store->first_line) stale++;
+                g_array_remove_range(lines, 0, stale);
+            }
+        }
+        chunk = g_malloc(sizeof(ConsoleChunk));
+        chunk->text_capacity = CONSOLE_CHUNK_TEXT_INITIAL;
+        chunk->text = g_malloc(chunk->text_capacity);
+        chunk->text_length = 0;
+        chunk->offsets[0] = 0;
+        chunk->count = 0;
+        memset(chunk->trigrams, 0, sizeof(chunk->trigrams));
+        g_ptr_array_add(store->chunks, chunk);
+    }
+    
+    if (chunk->text_length + length > chunk->text_capacity) {
+        while (chunk->text_length + length > chunk->text_capacity) chunk->text_capacity *= 2;
+        chunk->text = g_realloc(chunk->text, chunk->text_capacity);
+    }
+    memcpy(chunk->text + chunk->text_length, text, length);
+    chunk->text_length += length;
+    chunk->types[chunk->count] = (guint8)type;
+    chunk->offsets[++chunk->count] = (guint32)chunk->text_length;
+    
+    for (gsize i = 0; i + 2 < length; i++) {
+        guint bit = console_trigram_bit(g_ascii_tolower(text[i]), g_ascii_tolower(text[i + 1]),
+                                        g_ascii_tolower(text[i + 2]));
+        chunk->trigrams[bit / 64] |= G_GUINT64_CONSTANT(1) << (bit % 64);
+    }
+    
+    guint64 number = store->first_line + store->line_count;
+    if ((guint)type < STATUS_TYPE_COUNT) g_array_append_val(store->severity_lines[type], number);
+    store->line_count++;
+}
+
+// Line index counts from the oldest stored line; the text is not NUL-terminated
+static const gchar *console_store_line(const ConsoleStore *store, guint index, gsize *length, StatusType *type) {
+    const ConsoleChunk *chunk = g_ptr_array_index(store->chunks, index / CONSOLE_CHUNK_LINES);
+    guint line = index % CONSOLE_CHUNK_LINES;
+    
+    *length = chunk->offsets[line + 1] - chunk->offsets[line];
+    if (type) *type = (StatusType)chunk->types[line];
+    return chunk->text + chunk->offsets[line];
+}
+
+static void console_store_clear(ConsoleStore *store) {
+    for (guint i = 0; i < store->chunks->len; i++) {
+        ConsoleChunk *chunk = g_ptr_array_index(store->chunks, i);
+        g_free(chunk->text);
+        g_free(chunk);
+    }
+    g_ptr_array_free(store->chunks, TRUE);
+    store->chunks = NULL;
+    store->line_count = 0;
+    
+    for (gint i = 0; i < STATUS_TYPE_COUNT; i++) {
+        g_array_free(store->severity_lines[i], TRUE);
+        store->severity_lines[i] = NULL;
+    }
+}
+
+// Bloom filter bit for a case-folded trigram
+static guint console_trigram_bit(guchar a, guchar b, guchar c) {
+    guint32 key = ((guint32)a << 16) | ((guint32)b << 8) | c;
+    return (key * 2654435761u) >> (32 - CONSOLE_BLOOM_SHIFT);
+}
+
+// FALSE when some trigram of the case-folded query never occurs in the chunk
+static gboolean console_chunk_may_contain(const ConsoleChunk *chunk, const gchar *query) {
+    for (gsize i = 0; query[i] && query[i + 1] && query[i + 2]; i++) {
+        guint bit = console_trigram_bit(query[i], query[i + 1], query[i + 2]);
+        if (!(chunk->trigrams[bit / 64] & (G_GUINT64_CONSTANT(1) << (bit % 64)))) return FALSE;
+    }
+    return TRUE;
+}
+
+// ASCII case-insensitive substring search, query is already folded
+static gboolean console_find_folded(const gchar *text, gsize length, const gchar *query, gsize query_length) {
+    if (query_length > length) return FALSE;
+    
+    for (gsize start = 0; start + query_length <= length; start++) {
+        gsize i = 0;
+        while (i < query_length && g_ascii_tolower(text[start + i]) == query[i]) i++;
+        if (i == query_length) return TRUE;
+    }
+    return FALSE;
+}
+
+static gboolean console_line_matches(const ConsoleFilter *filter, const ConsoleChunk *chunk, guint line) {
+    if (filter->invalid) return FALSE;
+    if (filter->severity >= 0 && chunk->types[line] != filter->severity) return FALSE;
+    if (!filter->query) return TRUE;
+    
+    const gchar *text = chunk->text + chunk->offsets[line];
+    gsize length = chunk->offsets[line + 1] - chunk->offsets[line];
+    if (filter->regex) return g_regex_match_full(filter->regex, text, length, 0, 0, NULL, NULL);
+    return console_find_folded(text, length, filter->query, strlen(filter->query));
+}
+
+// Forget filtered rows whose lines were dropped from the store and test the lines appended
+// since the last call. Returns how many rows disappeared from the front of the view.
+static guint console_filter_sync(AppData *data) {
+    ConsoleFilter *filter = &data->console_filter;
+    const ConsoleStore *store = &data->console_store;
+    guint64 end = store->first_line + store->line_count;
+    guint dropped = 0;
+    
+    if (!filter->rows) {
+        dropped = (guint)(store->first_line - data->console_synced_first_line);
+    } else {
+        while (dropped < filter->rows->len && g_array_index(filter->rows, guint64, dropped) < store->first_line) dropped++;
+        g_array_remove_range(filter->rows, 0, dropped);
+        
+        for (guint64 number = MAX(filter->scanned_until, store->first_line); number < end; number++) {
+            guint index = (guint)(number - store->first_line);
+            const ConsoleChunk *chunk = g_ptr_array_index(store->chunks, index / CONSOLE_CHUNK_LINES);
+            if (console_line_matches(filter, chunk, index % CONSOLE_CHUNK_LINES)) g_array_append_val(filter->rows, number);
+        }
+    }
+    
+    filter->scanned_until = end;
+    data->console_synced_first_line = store->first_line;
+    return dropped;
+}
+
+// Work out the filtered rows from the severity lists and the chunk trigram filters. A plain
+// query that extends the previous one only narrows the rows already found.
+static void console_filter_rebuild(AppData *data) {
+    ConsoleFilter *filter = &data->console_filter;
+    const ConsoleStore *store = &data->console_store;
+    gint severity = console_severity_filters[gtk_combo_box_get_active(GTK_COMBO_BOX(data->console_severity_combo))].severity;
+    gboolean use_regex = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(data->console_regex_check));
+    const gchar *text = gtk_entry_get_text(GTK_ENTRY(data->console_search_entry));
+    gchar *query = text[0] ? (use_regex ? g_strdup(text) : g_ascii_strdown(text, -1)) : NULL;
+    
+    gboolean narrowing = filter->rows && !filter->invalid && !use_regex && !filter->regex && query &&
+                         filter->severity == severity && (!filter->query || strstr(query, filter->query));
+    
+    console_filter_sync(data);
+    g_free(filter->query);
+    filter->query = query;
+    filter->severity = severity;
+    filter->invalid = FALSE;
+    if (filter->regex) g_regex_unref(filter->regex);
+    filter->regex = NULL;
+    
+    GtkStyleContext *entry_style = gtk_widget_get_style_context(data->console_search_entry);
+    gtk_style_context_remove_class(entry_style, "error");
+    if (query && use_regex) {
+        filter->regex = g_regex_new(query, G_REGEX_CASELESS | G_REGEX_OPTIMIZE, 0, NULL);
+        if (!filter->regex) {
+            filter->invalid = TRUE;
+            gtk_style_context_add_class(entry_style, "error");
+        }
+    }
+    
+    if (narrowing) {
+        guint kept = 0;
+        for (guint i = 0; i < filter->rows->len; i++) {
+            guint64 number = g_array_index(filter->rows, guint64, i);
+            guint index = (guint)(number - store->first_line);
+            const ConsoleChunk *chunk = g_ptr_array_index(store->chunks, index / CONSOLE_CHUNK_LINES);
+            if (console_line_matches(filter, chunk, index % CONSOLE_CHUNK_LINES)) {
+                g_array_index(filter->rows, guint64, kept++) = number;
+            }
+        }
+        g_array_set_size(filter->rows, kept);
+        return;
+    }
+    
+    if (filter->rows) g_array_free(filter->rows, TRUE);
+    filter->rows = NULL;
+    if (severity < 0 && !query) return;
+    
+    filter->rows = g_array_new(FALSE, FALSE, sizeof(guint64));
+    if (filter->invalid) return;
+    
+    if (!query) {
+        GArray *lines = store->severity_lines[severity];
+        g_array_append_vals(filter->rows, lines->data, lines->len);
+    } else if (severity >= 0) {
+        GArray *lines = store->severity_lines[severity];
+        for (guint i = 0; i < lines->len; i++) {
+            guint64 number = g_array_index(lines, guint64, i);
+            guint index = (guint)(number - store->first_line);
+            const ConsoleChunk *chunk = g_ptr_array_index(store->chunks, index / CONSOLE_CHUNK_LINES);
+            if (!filter->regex && !console_chunk_may_contain(chunk, query)) continue;
+            if (console_line_matches(filter, chunk, index % CONSOLE_CHUNK_LINES)) g_array_append_val(filter->rows, number);
+        }
+    } else {
+        for (guint c = 0; c < store->chunks->len; c++) {
+            const ConsoleChunk *chunk = g_ptr_array_index(store->chunks, c);
+            if (!filter->regex && !console_chunk_may_contain(chunk, query)) continue;
+            
+            for (guint line = 0; line < chunk->count; line++) {
+                if (!console_line_matches(filter, chunk, line)) continue;
+                guint64 number = store->first_line + (guint64)c * CONSOLE_CHUNK_LINES + line;
+                g_array_append_val(filter->rows, number);
+            }
+        }
+    }
+}
+
+// Apply the new filter and show its newest rows
+static void on_console_filter_changed(GtkWidget *widget G_GNUC_UNUSED, AppData *data) {
+    console_filter_rebuild(data);
+    gtk_adjustment_set_value(data->console_adjustment, G_MAXDOUBLE);
+    flush_console(data);
+}
+
+// Rows that fit in the console view
+static gdouble console_visible_rows(AppData *data) {
+    gint height = gtk_widget_get_allocated_height(data->console_view) - 2 * CONSOLE_PADDING;
+    return MAX(height / data->console_row_height, 1);
+}
+
+// Draw the visible rows only, Pango elides the long ones as they are laid out
+static gboolean on_console_draw(GtkWidget *widget, cairo_t *cr, AppData *data) {
+    GtkStyleContext *style = gtk_widget_get_style_context(widget);
+    gint width = gtk_widget_get_allocated_width(widget);
+    gint height = gtk_widget_get_allocated_height(widget);
+    gtk_render_background(style, cr, 0, 0, width, height);
+    
+    if (!data->console_layout) on_console_style_updated(widget, data);
+    
+    GdkRGBA color;
+    gtk_style_context_get_color(style, gtk_style_context_get_state(style), &color);
+    gdk_cairo_set_source_rgba(cr, &color);
+    pango_layout_set_width(data->console_layout, MAX(width - 2 * CONSOLE_PADDING, 1) * PANGO_SCALE);
+    
+    const ConsoleStore *store = &data->console_store;
+    const GArray *filtered = data->console_filter.rows;
+    guint row_count = filtered ? filtered->len : store->line_count;
+    guint first = (guint)gtk_adjustment_get_value(data->console_adjustment);
+    gint rows = (height - CONSOLE_PADDING) / data->console_row_height + 1;
+    
+    for (gint row = 0; row < rows && first + row < row_count; row++) {
+        guint index = filtered ? (guint)(g_array_index(filtered, guint64, first + row) - store->first_line) : first + row;
+        gsize length;
+        const gchar *text = console_store_line(store, index, &length, NULL);
+        pango_layout_set_text(data->console_layout, text, (gint)length);
+        cairo_move_to(cr, CONSOLE_PADDING, CONSOLE_PADDING + row * data->console_row_height);
+        pango_cairo_show_layout(cr, data->console_layout);
+    }
+    
+    return FALSE;
+}
+
+static void on_console_size_allocate(GtkWidget *widget G_GNUC_UNUSED, GdkRectangle *allocation G_GNUC_UNUSED,
+                                     AppData *data) {
+    flush_console(data);
+}
+
+// Pick up the CSS font and measure the row height again
+static void on_console_style_updated(GtkWidget *widget, AppData *data) {
+    if (data->console_layout) g_object_unref(data->console_layout);
+    data->console_layout = gtk_widget_create_pango_layout(widget, "Xg");
+    pango_layout_set_ellipsize(data->console_layout, PANGO_ELLIPSIZE_END);
+    
+    gint row_width, row_height;
+    pango_layout_get_pixel_size(data->console_layout, &row_width, &row_height);
+    data->console_row_height = MAX(row_height, 1);
+    flush_console(data);
+}
+
+static gboolean on_console_scroll(GtkWidget *widget G_GNUC_UNUSED, GdkEventScroll *event, AppData *data) {
+    gdouble delta = 0.0;
+    switch (event->direction) {
+        case GDK_SCROLL_UP: delta = -CONSOLE_SCROLL_LINES; break;
+        case GDK_SCROLL_DOWN: delta = CONSOLE_SCROLL_LINES; break;
+        case GDK_SCROLL_SMOOTH: delta = event->delta_y * CONSOLE_SCROLL_LINES; break;
+        default: return FALSE;
+    }
+    
+    GtkAdjustment *adjustment = data->console_adjustment;
+    gdouble bottom = gtk_adjustment_get_upper(adjustment) - gtk_adjustment_get_page_size(adjustment);
+    gtk_adjustment_set_value(adjustment, CLAMP(gtk_adjustment_get_value(adjustment) + delta, 0.0, MAX(bottom, 0.0)));
+    return TRUE;
+}
+
+static void on_console_scrolled(GtkAdjustment *adjustment G_GNUC_UNUSED, AppData *data) {
+    gtk_widget_queue_draw(data->console_view);
+}
+
+// "HH:MM:SS" for a timestamp, formatted once per second
+static const gchar *console_timestamp(AppData *data, gint64 timestamp_us) {
+    gint64 second = timestamp_us / G_USEC_PER_SEC;
+    if (second != data->console_stamp_second) {
+        time_t seconds = (time_t)second;
+        struct tm local;
+        localtime_r(&seconds, &local);
+        strftime(data->console_stamp, sizeof(data->console_stamp), "%H:%M:%S", &local);
+        data->console_stamp_second = second;
+    }
+    return data->console_stamp;
+}
+
+// Queue a log message from any thread. It is always journaled, the console drops and
+// counts it if the ring is full.
+static void post_log_message(AppData *data, StatusType type, const gchar *format, ...) {
+    guint position;
+    LogEvent *event = log_ring_claim(&data->log_ring, &position);
+    gchar overflow[LOG_EVENT_TEXT_MAX];
+    gchar *text = event ? event->text : overflow;
+    
+    va_list args;
+    va_start(args, format);
+    g_vsnprintf(text, LOG_EVENT_TEXT_MAX, format, args);
+    va_end(args);
+    
+    journal_post(data->journal, JOURNAL_RECORD_LOG, type, text);
+    if (!event) return;
+    
+    event->kind = LOG_EVENT_LINE;
+    event->type = type;
+    event->timestamp = g_get_real_time();
+    log_ring_publish(event, position);
+}
+
+// Queue a command output line for the console only, the caller journals it
+static void post_output_line(AppData *data, StatusType type, const gchar *line) {
+    guint position;
+    LogEvent *event = log_ring_claim(&data->log_ring, &position);
+    if (!event) return;
+    
+    g_strlcpy(event->text, line, sizeof(event->text));
+    event->kind = LOG_EVENT_LINE;
+    event->type = type;
+    event->timestamp = g_get_real_time();
+    log_ring_publish(event, position);
+}
+
+// Queue a progress bar update from any thread
+static void post_progress(AppData *data, gdouble progress, const gchar *label) {
+    guint position;
+    LogEvent *event = log_ring_claim(&data->log_ring, &position);
+    if (!event) return;
+    
+    g_strlcpy(event->text, label, sizeof(event->text));
+    event->kind = LOG_EVENT_PROGRESS;
+    event->type = STATUS_INFO;
+    event->progress = progress;
+    event->timestamp = g_get_real_time();
+    log_ring_publish(event, position);
+}
+
+// name under APP_STATE_SUBDIR in the user state dir, or the directory itself for NULL.
+// g_get_user_state_dir is GLib 2.72, focal and bullseye ship older.
+static gchar *app_state_path(const gchar *name) {
+#if GLIB_CHECK_VERSION(2, 72, 0)
+    gchar *state_dir = g_strdup(g_get_user_state_dir());
+#else
+    const gchar *xdg_state_home = g_getenv("XDG_STATE_HOME");
+    gchar *state_dir = (xdg_state_home && g_path_is_absolute(xdg_state_home))
+        ? g_strdup(xdg_state_home)
+        : g_build_filename(g_get_home_dir(), ".local", "state", NULL);
+#endif
+    gchar *path = g_build_filename(state_dir, APP_STATE_SUBDIR, name, NULL);
+    g_free(state_dir);
+    return path;
+}
+
+// Start the journal writer, in JOURNAL_DIR when it is writable and the user state dir otherwise
+static Journal *journal_open(void) {
+    Journal *journal = g_malloc0(sizeof(Journal));
+    journal->fd = -1;
+    
+    gchar *fallback = app_state_path(NULL);
+    gboolean opened = (access(JOURNAL_DIR, W_OK) == 0 && journal_open_file(journal, JOURNAL_DIR)) ||
+                      journal_open_file(journal, fallback);
+    g_free(fallback);
+    if (!opened) {
+        g_free(journal);
+        return NULL;
+    }
+    
+    journal->queue = g_async_queue_new_full(journal_record_free);
+    pthread_create(&journal->writer_thread, NULL, journal_writer_thread, journal);
+    
+    gchar *session = g_strdup_printf("%s %s started on %s, pid %d, journal %s", APP_TITLE, APP_VERSION,
+                                     g_get_host_name(), (gint)getpid(), journal->path);
+    journal_post(journal, JOURNAL_RECORD_LOG, STATUS_INFO, session);
+    g_free(session);
+    return journal;
+}
+
+// Write out everything queued, then stop the writer
+static void journal_close(Journal *journal) {
+    if (!journal) return;
+    
+    journal_post(journal, JOURNAL_RECORD_STOP, STATUS_INFO, NULL);
+    pthread_join(journal->writer_thread, NULL);
+    g_async_queue_unref(journal->queue);
+    if (journal->fd >= 0) close(journal->fd);
+    g_free(journal->directory);
+    g_free(journal->path);
+    g_free(journal);
+}
+
+// Queue a record from any thread, never touches the disk
+static void journal_post(Journal *journal, JournalRecordKind kind, StatusType type, const gchar *text) {
+    if (!journal) return;
+    
+    JournalRecord *record = g_malloc(sizeof(JournalRecord));
+    record->kind = kind;
+    record->type = type;
+    record->is_stderr = FALSE;
+    record->result = 0;
+    record->timestamp = g_get_real_time();
+    record->text = g_strdup(text);
+    g_async_queue_push(journal->queue, record);
+}
+
+static void journal_post_output(Journal *journal, StatusType type, const gchar *line, gboolean is_stderr) {
+    if (!journal) return;
+    
+    JournalRecord *record = g_malloc(sizeof(JournalRecord));
+    record->kind = JOURNAL_RECORD_OUTPUT;
+    record->type = type;
+    record->is_stderr = is_stderr;
+    record->result = 0;
+    record->timestamp = g_get_real_time();
+    record->text = g_strdup(line);
+    g_async_queue_push(journal->queue, record);
+}
+
+// Step boundary: the writer fsyncs once this record is written
+static void journal_step_end(Journal *journal, const gchar *step, gint result) {
+    if (!journal) return;
+    
+    JournalRecord *record = g_malloc(sizeof(JournalRecord));
+    record->kind = JOURNAL_RECORD_STEP_END;
+    record->type = result == 0 ? STATUS_SUCCESS : (result == COMMAND_CANCELLED ? STATUS_WARNING : STATUS_ERROR);
+    record->is_stderr = FALSE;
+    record->result = result;
+    record->timestamp = g_get_real_time();
+    record->text = g_strdup(step);
+    g_async_queue_push(journal->queue, record);
+}
+
+// Ask the writer to continue in JOURNAL_DIR once the privileged helper has created it
+static void journal_relocate(Journal *journal) {
+    journal_post(journal, JOURNAL_RECORD_RELOCATE, STATUS_INFO, NULL);
+}
+
+static void journal_record_free(gpointer data) {
+    JournalRecord *record = (JournalRecord *)data;
+    g_free(record->text);
+    g_free(record);
+}
+
+// Take whatever is queued, up to JOURNAL_BATCH_MAX records, and write it with one write()
+static void *journal_writer_thread(void *arg) {
+    Journal *journal = (Journal *)arg;
+    GString *batch = g_string_sized_new(64 * 1024);
+    gboolean running = TRUE;
+    
+    while (running) {
+        JournalRecord *record = g_async_queue_pop(journal->queue);
+        gboolean sync = FALSE;
+        
+        for (guint count = 1; record; count++) {
+            if (record->kind == JOURNAL_RECORD_STOP) {
+                running = FALSE;
+                sync = TRUE;
+            } else if (record->kind == JOURNAL_RECORD_RELOCATE) {
+                if (g_strcmp0(journal->directory, JOURNAL_DIR) != 0 && access(JOURNAL_DIR, W_OK) == 0) {
+                    gchar *previous = g_strdup(journal->path);
+                    journal_write_batch(journal, batch, TRUE);
+                    close(journal->fd);
+                    journal->fd = -1;
+                    
+                    if (journal_open_file(journal, JOURNAL_DIR)) {
+                        record->text = g_strdup_printf("Journal continued from %s", previous);
+                        record->kind = JOURNAL_RECORD_LOG;
+                        journal_format_record(journal, batch, record);
+                    } else {
+                        // Back to where we were
+                        gchar *directory = g_path_get_dirname(previous);
+                        journal_open_file(journal, directory);
+                        g_free(directory);
+                    }
+                    g_free(previous);
+                }
+            } else {
+                journal_format_record(journal, batch, record);
+                sync |= record->kind == JOURNAL_RECORD_STEP_END;
+            }
+            journal_record_free(record);
+            record = running && count < JOURNAL_BATCH_MAX ? g_async_queue_try_pop(journal->queue) : NULL;
+        }
+        
+        journal_write_batch(journal, batch, sync);
+    }
+    
+    g_string_free(batch, TRUE);
+    return NULL;
+}
+
+static gboolean journal_open_file(Journal *journal, const gchar *directory) {
+    if (g_mkdir_with_parents(directory, 0750) != 0) return FALSE;
+    
+    gchar *path = g_build_filename(directory, JOURNAL_FILE_NAME, NULL);
+    gint fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        g_free(path);
+        return FALSE;
+    }
+    
+    if (journal->fd >= 0) close(journal->fd);
+    journal->fd = fd;
+    journal->size = (gsize)st.st_size;
+    g_free(journal->directory);
+    journal->directory = g_strdup(directory);
+    g_free(journal->path);
+    journal->path = path;
+    return TRUE;
+}
+
+// {"time":"...","seq":N,"kind":"...","status":"...",...} and a newline
+static void journal_format_record(Journal *journal, GString *out, const JournalRecord *record) {
+    static const gchar *const kind_names[] = { "log", "output", "step_begin", "step_end" };
+    static const gchar *const status_names[STATUS_TYPE_COUNT] = { "unknown", "success", "warning", "error", "info" };
+    
+    time_t seconds = (time_t)(record->timestamp / G_USEC_PER_SEC);
+    struct tm utc;
+    gmtime_r(&seconds, &utc);
+    gchar stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &utc);
+    
+    g_string_append_printf(out, "{\"time\":\"%s.%06dZ\",\"seq\":%" G_GUINT64_FORMAT ",\"kind\":\"%s\",\"status\":\"%s\"",
+                           stamp, (gint)(record->timestamp % G_USEC_PER_SEC), journal->sequence++,
+                           kind_names[record->kind], status_names[record->type]);
+    
+    switch (record->kind) {
+        case JOURNAL_RECORD_OUTPUT:
+            g_string_append_printf(out, ",\"stream\":\"%s\",\"text\":", record->is_stderr ? "stderr" : "stdout");
+            break;
+        case JOURNAL_RECORD_STEP_BEGIN:
+            g_string_append(out, ",\"step\":");
+            break;
+        case JOURNAL_RECORD_STEP_END:
+            g_string_append_printf(out, ",\"result\":%d,\"step\":", record->result);
+            break;
+        default:
+            g_string_append(out, ",\"text\":");
+            break;
+    }
+    journal_append_json_string(out, record->text ? record->text : "");
+    g_string_append(out, "}\n");
+}
+
+// Quoted JSON string; command output that is not UTF-8 is repaired first
+static void journal_append_json_string(GString *out, const gchar *text) {
+    gchar *repaired = g_utf8_validate(text, -1, NULL) ? NULL : g_utf8_make_valid(text, -1);
+    const guchar *p = (const guchar *)(repaired ? repaired : text);
+    
+    g_string_append_c(out, '"');
+    for (; *p; p++) {
+        switch (*p) {
+            case '"': g_string_append(out, "\\\""); break;
+            case '\\': g_string_append(out, "\\\\"); break;
+            case '\n': g_string_append(out, "\\n"); break;
+            case '\r': g_string_append(out, "\\r"); break;
+            case '\t': g_string_append(out, "\\t"); break;
+            default:
+                if (*p < 0x20) {
+                    g_string_append_printf(out, "\\u%04x", *p);
+                } else {
+                    g_string_append_c(out, (gchar)*p);
+                }
+                break;
+        }
+    }
+    g_string_append_c(out, '"');
+    g_free(repaired);
+}
+
+static void journal_write_batch(Journal *journal, GString *batch, gboolean sync) {
+    gsize written = 0;
+    while (written < batch->len) {
+        ssize_t n = write(journal->fd, batch->str + written, batch->len - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            if (!journal->write_failed) {
+                fprintf(stderr, "Cannot write %s: %s\n", journal->path, g_strerror(errno));
+                journal->write_failed = TRUE;
+            }
+            break;
+        }
+        written += (gsize)n;
+    }
+    journal->size += written;
+    g_string_truncate(batch, 0);
+    
+    if (sync) fsync(journal->fd);
+    if (journal->size >= JOURNAL_ROTATE_BYTES) journal_rotate(journal);
+}
+
+// Start a fresh journal and gzip the full one next to it
+static void journal_rotate(Journal *journal) {
+    fsync(journal->fd);
+    
+    gchar stamp[32];
+    time_t now = time(NULL);
+    struct tm utc;
+    gmtime_r(&now, &utc);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &utc);
+    
+    gchar *name = g_strdup_printf("install-%s-%" G_GUINT64_FORMAT ".jsonl", stamp, journal->sequence);
+    gchar *rotated = g_build_filename(journal->directory, name, NULL);
+    gchar *compressed = g_strconcat(rotated, ".gz", NULL);
+    
+    if (rename(journal->path, rotated) == 0) {
+        gchar *directory = g_strdup(journal->directory);
+        journal_open_file(journal, directory);
+        g_free(directory);
+        
+        if (journal_compress(rotated, compressed)) {
+            unlink(rotated);
+        } else {
+            unlink(compressed);
+        }
+        journal_prune(journal->directory);
+    }
     
-    GDateTime *now = g_date_time_new_now_local();
-    gchar *timestamp = g_date_time_format(now, "%H:%M:%S");
+    g_free(name);
+    g_free(rotated);
+    g_free(compressed);
+}
+
+static gboolean journal_compress(const gchar *path, const gchar *gz_path) {
+    gint fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return FALSE;
+    
+    GFile *file = g_file_new_for_path(gz_path);
+    GFileOutputStream *file_stream = g_file_replace(file, NULL, FALSE, G_FILE_CREATE_PRIVATE, NULL, NULL);
+    g_object_unref(file);
+    if (!file_stream) {
+        close(fd);
+        return FALSE;
+    }
     
-    const gchar *status_icon = "";
-    switch (type) {
-        case STATUS_SUCCESS: status_icon = "[OK]"; break;
-        case STATUS_WARNING: status_icon = "[WARN]"; break;
-        case STATUS_ERROR: status_icon = "[ERROR]"; break;
-        case STATUS_INFO: status_icon = "[INFO]"; break;
-        default: status_icon = "[*]"; break;
+    GZlibCompressor *compressor = g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1);
+    GOutputStream *stream = g_converter_output_stream_new(G_OUTPUT_STREAM(file_stream), G_CONVERTER(compressor));
+    g_object_unref(compressor);
+    g_object_unref(file_stream);
+    
+    gboolean ok = TRUE;
+    gchar *buffer = g_malloc(COMMAND_READ_CHUNK);
+    ssize_t n;
+    while (ok && (n = read(fd, buffer, COMMAND_READ_CHUNK)) != 0) {
+        if (n < 0) {
+            ok = (errno == EINTR);
+            continue;
+        }
+        ok = g_output_stream_write_all(stream, buffer, (gsize)n, NULL, NULL, NULL);
     }
+    ok = g_output_stream_close(stream, NULL, NULL) && ok;
     
-    gchar *formatted_message = g_strdup_printf("[%s] %s %s\n", timestamp, status_icon, message);
+    g_free(buffer);
+    g_object_unref(stream);
+    close(fd);
+    return ok;
+}
+
+static gint compare_journal_names(gconstpointer a, gconstpointer b) {
+    return strcmp(*(const gchar *const *)a, *(const gchar *const *)b);
+}
+
+// Keep the newest JOURNAL_KEEP_ROTATED compressed journals, names sort by rotation time
+static void journal_prune(const gchar *directory) {
+    GDir *dir = g_dir_open(directory, 0, NULL);
+    if (!dir) return;
+    
+    GPtrArray *names = g_ptr_array_new_with_free_func(g_free);
+    const gchar *name;
+    while ((name = g_dir_read_name(dir)) != NULL) {
+        if (g_str_has_prefix(name, "install-") && g_str_has_suffix(name, ".jsonl.gz")) {
+            g_ptr_array_add(names, g_strdup(name));
+        }
+    }
+    g_dir_close(dir);
     
-    // Check line count and trim if necessary
-    gint line_count = gtk_text_buffer_get_line_count(data->console_buffer);
-    if (line_count >= MAX_LOG_LINES) {
-        GtkTextIter start, end;
-        gtk_text_buffer_get_iter_at_line(data->console_buffer, &start, 0);
-        gtk_text_buffer_get_iter_at_line(data->console_buffer, &end, line_count - MAX_LOG_LINES + 1);
-        gtk_text_buffer_delete(data->console_buffer, &start, &end);
-        gtk_text_buffer_get_end_iter(data->console_buffer, &iter);
+    g_ptr_array_sort(names, compare_journal_names);
+    for (guint i = 0; i + JOURNAL_KEEP_ROTATED < names->len; i++) {
+        gchar *path = g_build_filename(directory, g_ptr_array_index(names, i), NULL);
+        unlink(path);
+        g_free(path);
+    }
+    g_ptr_array_free(names, TRUE);
+}
+
+// Privileged helper only: create JOURNAL_DIR and hand it to the user sudo authenticated
+static void prepare_journal_dir(void) {
+    if (mkdir(JOURNAL_DIR, 0750) != 0 && errno != EEXIST) return;
+    
+    const gchar *sudo_uid = g_getenv("SUDO_UID");
+    const gchar *sudo_gid = g_getenv("SUDO_GID");
+    if (!sudo_uid || !sudo_gid) return;
+    
+    // Never follow a link planted in place of the directory
+    gint fd = open(JOURNAL_DIR, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) return;
+    if (fchown(fd, (uid_t)g_ascii_strtoull(sudo_uid, NULL, 10), (gid_t)g_ascii_strtoull(sudo_gid, NULL, 10)) != 0) {
+        fprintf(stderr, "Cannot hand %s to uid %s: %s\n", JOURNAL_DIR, sudo_uid, g_strerror(errno));
+    }
+    close(fd);
+}
+
+// Every slot starts free for the producer whose position matches its index
+static void log_ring_init(LogRing *ring) {
+    for (guint i = 0; i < LOG_RING_CAPACITY; i++) {
+        ring->slots[i].sequence = i;
+    }
+    ring->enqueue_pos = 0;
+    ring->dequeue_pos = 0;
+    ring->dropped = 0;
+    ring->dropped_total = 0;
+}
+
+// Reserve the next slot for writing (bounded queue after Vyukov). A slot is free for the
+// producer at position p when its sequence equals p, and holds an event when it equals p + 1.
+// Returns NULL and counts a drop when the consumer has not freed the slot yet.
+static LogEvent *log_ring_claim(LogRing *ring, guint *position) {
+    guint pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+    
+    for (;;) {
+        LogEvent *event = &ring->slots[pos & (LOG_RING_CAPACITY - 1)];
+        guint sequence = __atomic_load_n(&event->sequence, __ATOMIC_ACQUIRE);
+        gint difference = (gint)(sequence - pos);
+        
+        if (difference == 0) {
+            // A failed exchange reloads pos with the current value
+            if (__atomic_compare_exchange_n(&ring->enqueue_pos, &pos, pos + 1, TRUE,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *position = pos;
+                return event;
+            }
+        } else if (difference < 0) {
+            __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Hand a filled slot to the consumer
+static void log_ring_publish(LogEvent *event, guint position) {
+    __atomic_store_n(&event->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+// Main thread: apply everything queued since the last tick. One pass is bounded by the ring
+// size, so a flood of output still leaves the main loop time to redraw.
+static gboolean drain_log_ring(gpointer user_data) {
+    AppData *data = (AppData *)user_data;
+    LogRing *ring = &data->log_ring;
+    
+    for (guint i = 0; i < LOG_RING_CAPACITY; i++) {
+        guint pos = ring->dequeue_pos;
+        LogEvent *event = &ring->slots[pos & (LOG_RING_CAPACITY - 1)];
+        if (__atomic_load_n(&event->sequence, __ATOMIC_ACQUIRE) != pos + 1) break;
+        
+        if (event->kind == LOG_EVENT_PROGRESS) {
+            gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(data->progress_bar), event->progress / 100.0);
+            gtk_progress_bar_set_text(GTK_PROGRESS_BAR(data->progress_bar), event->text);
+            gtk_label_set_text(GTK_LABEL(data->progress_label), event->text);
+        } else {
+            append_console_line(data, event->text, event->type, event->timestamp);
+        }
+        
+        __atomic_store_n(&event->sequence, pos + LOG_RING_CAPACITY, __ATOMIC_RELEASE);
+        ring->dequeue_pos = pos + 1;
     }
     
-    gtk_text_buffer_insert(data->console_buffer, &iter, formatted_message, -1);
+    guint dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+    ring->dropped_total += dropped;
+    if (dropped > 0) {
+        gchar *notice = g_strdup_printf("... %u log lines not shown, console was behind", dropped);
+        append_console_line(data, notice, STATUS_WARNING, g_get_real_time());
+        g_free(notice);
+    }
     
-    gtk_text_view_scroll_to_iter(GTK_TEXT_VIEW(data->console_textview), &iter, 0.0, FALSE, 0.0, 0.0);
+    flush_console(data);
+    return G_SOURCE_CONTINUE;
+}
+
+// Events posted but not drained yet, approximate while producers are running
+static guint log_ring_pending(LogRing *ring) {
+    return __atomic_load_n(&ring->enqueue_pos, __ATOMIC_RELAXED) -
+           __atomic_load_n(&ring->dequeue_pos, __ATOMIC_RELAXED);
+}
+
+// Feed the console from a worker thread as fast as the ring drains and measure frame gaps
+static void start_console_benchmark(AppData *data) {
+    ConsoleBenchmark *benchmark = g_malloc0(sizeof(ConsoleBenchmark));
+    benchmark->app_data = data;
+    benchmark->start_us = g_get_monotonic_time();
     
-    g_free(formatted_message);
-    g_free(timestamp);
-    g_date_time_unref(now);
+    gtk_widget_show(data->progress_frame);
+    gtk_widget_add_tick_callback(data->console_view, console_benchmark_tick, benchmark, NULL);
+    pthread_create(&benchmark->producer, NULL, console_benchmark_producer, benchmark);
 }
 
-// Run command and capture output
-static gint run_command(const gchar *command, gchar **output) {
-    FILE *pipe = popen(command, "r");
-    if (!pipe) return -1;
+static void *console_benchmark_producer(void *arg) {
+    ConsoleBenchmark *benchmark = (ConsoleBenchmark *)arg;
+    AppData *data = benchmark->app_data;
+    static const StatusType types[] = { STATUS_INFO, STATUS_INFO, STATUS_INFO, STATUS_WARNING, STATUS_ERROR };
+    
+    while (!g_atomic_int_get(&benchmark->stop)) {
+        // Back off before the ring fills, the benchmark measures the console, not drops
+        if (log_ring_pending(&data->log_ring) > LOG_RING_CAPACITY * 3 / 4) {
+            g_usleep(1000);
+            continue;
+        }
+        guint64 n = benchmark->lines_posted++;
+        post_log_message(data, types[n % G_N_ELEMENTS(types)],
+                         "Get:%" G_GUINT64_FORMAT " https://developer.download.nvidia.com/compute/cuda/repos "
+                         "cuda-toolkit-12-6 [%" G_GUINT64_FORMAT " kB]", n, n % 4096);
+    }
+    return NULL;
+}
+
+// Runs once per frame; ends the benchmark and prints the result after CONSOLE_BENCHMARK_SECONDS
+static gboolean console_benchmark_tick(GtkWidget *widget G_GNUC_UNUSED, GdkFrameClock *clock, gpointer user_data) {
+    ConsoleBenchmark *benchmark = (ConsoleBenchmark *)user_data;
+    gint64 frame_us = gdk_frame_clock_get_frame_time(clock);
+    
+    if (benchmark->last_frame_us > 0) {
+        gint64 gap = frame_us - benchmark->last_frame_us;
+        benchmark->max_frame_gap_us = MAX(benchmark->max_frame_gap_us, gap);
+        if (gap > CONSOLE_BENCHMARK_SLOW_FRAME_US) benchmark->slow_frames++;
+    }
+    benchmark->last_frame_us = frame_us;
+    benchmark->frames++;
+    
+    gdouble elapsed = (g_get_monotonic_time() - benchmark->start_us) / (gdouble)G_USEC_PER_SEC;
+    if (elapsed < CONSOLE_BENCHMARK_SECONDS) return G_SOURCE_CONTINUE;
+    
+    g_atomic_int_set(&benchmark->stop, 1);
+    pthread_join(benchmark->producer, NULL);
+    
+    // Drops since the last drain have not been added to the total yet
+    AppData *data = benchmark->app_data;
+    guint dropped = data->log_ring.dropped_total + __atomic_load_n(&data->log_ring.dropped, __ATOMIC_RELAXED);
+    printf("Console benchmark: %" G_GUINT64_FORMAT " lines in %.1f s (%.0f lines/s), %u ring drops\n",
+           data->console_lines_total, elapsed, data->console_lines_total / elapsed, dropped);
+    printf("Frames: %u (%.1f fps), max frame gap %.1f ms, %u frames over %.1f ms\n",
+           benchmark->frames, benchmark->frames / elapsed, benchmark->max_frame_gap_us / 1000.0,
+           benchmark->slow_frames, CONSOLE_BENCHMARK_SLOW_FRAME_US / 1000.0);
+    
+    g_free(benchmark);
+    gtk_main_quit();
+    return G_SOURCE_REMOVE;
+}
+
+// Read buffer shared by every command a thread runs
+static GPrivate command_chunk_key = G_PRIVATE_INIT(g_free);
+
+static gchar *get_command_chunk(void) {
+    gchar *chunk = g_private_get(&command_chunk_key);
+    if (!chunk) {
+        chunk = g_malloc(COMMAND_READ_CHUNK);
+        g_private_set(&command_chunk_key, chunk);
+    }
+    return chunk;
+}
+
+// Split a chunk of output into lines, keeping the unterminated tail in partial
+static void split_output_lines(const CommandSink *sink, GString *partial,
+                               const gchar *data, gsize length, gboolean is_stderr) {
+    const gchar *end = data + length;
+    
+    while (data < end) {
+        const gchar *eol = data;
+        while (eol < end && *eol != '\n' && *eol != '\r') eol++;
+        
+        g_string_append_len(partial, data, eol - data);
+        if (eol == end && partial->len < OUTPUT_LINE_MAX) break;
+        
+        // Progress meters redraw with '\r', empty redraws are skipped
+        if (partial->len > 0) {
+            sink->line(sink->user_data, partial->str, is_stderr);
+            g_string_truncate(partial, 0);
+        }
+        data = (eol == end) ? end : eol + 1;
+    }
+}
+
+// Spawn argv without a shell and collect stdout and stderr separately.
+// The child leads its own process group, so a timeout or cancel kills everything it started.
+// Returns the exit code, 128 + signal number if killed, 127 if it could not be started,
+// or COMMAND_TIMED_OUT / COMMAND_CANCELLED.
+static gint execute_command(const CommandRequest *request) {
+    if (cancel_token_is_cancelled(request->cancel)) return COMMAND_CANCELLED;
+    
+    gint out_pipe[2] = { -1, -1 };
+    gint err_pipe[2] = { -1, -1 };
+    gint in_pipe[2] = { -1, -1 };
+    gint status_pipe[2] = { -1, -1 };
+    
+    if (pipe2(out_pipe, O_CLOEXEC) != 0 || pipe2(err_pipe, O_CLOEXEC) != 0 ||
+        (request->input && pipe2(in_pipe, O_CLOEXEC) != 0) ||
+        (request->status && pipe2(status_pipe, O_CLOEXEC) != 0)) {
+        gint saved_errno = errno;
+        for (gint i = 0; i < 2; i++) {
+            if (out_pipe[i] >= 0) close(out_pipe[i]);
+            if (err_pipe[i] >= 0) close(err_pipe[i]);
+            if (in_pipe[i] >= 0) close(in_pipe[i]);
+            if (status_pipe[i] >= 0) close(status_pipe[i]);
+        }
+        if (request->err) g_string_append_printf(request->err, "pipe: %s\n", g_strerror(saved_errno));
+        return -1;
+    }
+    
+    // Only the three standard descriptors and APT_STATUS_FD reach the child, everything else is close-on-exec
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (request->input) {
+        posix_spawn_file_actions_adddup2(&actions, in_pipe[0], STDIN_FILENO);
+    } else {
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    }
+    posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, err_pipe[1], STDERR_FILENO);
+    if (request->status) posix_spawn_file_actions_adddup2(&actions, status_pipe[1], APT_STATUS_FD);
+#ifdef HAVE_SPAWN_ADDCLOSEFROM
+    posix_spawn_file_actions_addclosefrom_np(&actions, (request->status ? APT_STATUS_FD : STDERR_FILENO) + 1);
+#endif
+    
+    // The app ignores SIGPIPE, children get the default back
+    posix_spawnattr_t attributes;
+    sigset_t default_signals;
+    posix_spawnattr_init(&attributes);
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attributes, &default_signals);
+    posix_spawnattr_setpgroup(&attributes, 0);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+    
+    pid_t pid;
+    gint spawn_error = posix_spawnp(&pid, request->argv[0], &actions, &attributes,
+                                    (gchar *const *)request->argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+    
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+    if (request->input) close(in_pipe[0]);
+    if (request->status) close(status_pipe[1]);
+    
+    if (spawn_error != 0) {
+        close(out_pipe[0]);
+        close(err_pipe[0]);
+        if (request->input) close(in_pipe[1]);
+        if (request->status) close(status_pipe[0]);
+        if (request->err) {
+            g_string_append_printf(request->err, "%s: %s\n", request->argv[0], g_strerror(spawn_error));
+        }
+        return 127;
+    }
+    
+    const gchar *input = request->input;
+    gsize input_left = input ? strlen(input) : 0;
+    if (input) fcntl(in_pipe[1], F_SETFL, O_NONBLOCK);
+    
+    gchar *chunk = get_command_chunk();
+    gint pidfd = open_pidfd(pid);
+    struct pollfd fds[6] = {
+        { out_pipe[0], POLLIN, 0 },
+        { err_pipe[0], POLLIN, 0 },
+        { input ? in_pipe[1] : -1, POLLOUT, 0 },
+        { pidfd, POLLIN, 0 },
+        { request->cancel ? request->cancel->fds[0] : -1, POLLIN, 0 },
+        { status_pipe[0], POLLIN, 0 },
+    };
+    GString *sinks[2] = { request->out, request->err };
+    GString *partial[2] = { NULL, NULL };
+    const CommandSink *line_sink = request->sink;
+    GString *status_partial = request->status ? g_string_new(NULL) : NULL;
+    
+    if (line_sink) {
+        partial[0] = g_string_new(NULL);
+        partial[1] = g_string_new(NULL);
+    }
+    
+    if (input && input_left == 0) {
+        close(fds[2].fd);
+        fds[2].fd = -1;
+    }
+    
+    gint64 now = g_get_monotonic_time() / 1000;
+    gint64 deadline = request->timeout_ms > 0 ? now + request->timeout_ms : G_MAXINT64;
+    gint64 kill_at = G_MAXINT64;        // SIGKILL escalation once terminating
+    gint64 drain_until = G_MAXINT64;    // Set when the child exits
+    gint outcome = 0;                   // COMMAND_TIMED_OUT or COMMAND_CANCELLED once terminating
+    gboolean exited = FALSE;
+    gint status = 0;
+    
+    // Runs until the child is reaped and its output is drained; a daemonized grandchild
+    // holding the pipes open only gets COMMAND_DRAIN_GRACE_MS
+    while (!exited || ((fds[0].fd >= 0 || fds[1].fd >= 0 || fds[5].fd >= 0) && now < drain_until)) {
+        gint64 wake = MIN(MIN(deadline, kill_at), drain_until);
+        if (pidfd < 0 && !exited) wake = MIN(wake, now + COMMAND_REAP_INTERVAL_MS);
+        gint timeout = wake == G_MAXINT64 ? -1 : (gint)CLAMP(wake - now, 0, G_MAXINT);
+        
+        gint ready = poll(fds, G_N_ELEMENTS(fds), timeout);
+        now = g_get_monotonic_time() / 1000;
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        
+        for (gint i = 0; i < 2; i++) {
+            if (fds[i].fd < 0 || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            
+            ssize_t len = read(fds[i].fd, chunk, COMMAND_READ_CHUNK);
+            if (len > 0) {
+                if (sinks[i]) g_string_append_len(sinks[i], chunk, len);
+                if (line_sink) split_output_lines(line_sink, partial[i], chunk, len, i == 1);
+            } else if (len == 0 || (errno != EINTR && errno != EAGAIN)) {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+            }
+        }
+        
+        if (fds[5].fd >= 0 && (fds[5].revents & (POLLIN | POLLHUP | POLLERR))) {
+            ssize_t len = read(fds[5].fd, chunk, COMMAND_READ_CHUNK);
+            if (len > 0) {
+                split_output_lines(request->status, status_partial, chunk, len, FALSE);
+            } else if (len == 0 || (errno != EINTR && errno != EAGAIN)) {
+                close(fds[5].fd);
+                fds[5].fd = -1;
+            }
+        }
+        
+        if (fds[2].fd >= 0 && (fds[2].revents & (POLLOUT | POLLERR | POLLHUP))) {
+            ssize_t written = write(fds[2].fd, input, input_left);
+            if (written > 0) {
+                input += written;
+                input_left -= written;
+            }
+            if (input_left == 0 || (written < 0 && errno != EAGAIN && errno != EINTR)) {
+                close(fds[2].fd);
+                fds[2].fd = -1;
+            }
+        }
+        
+        if (!exited && (pidfd < 0 || (fds[3].revents & POLLIN)) && waitpid(pid, &status, WNOHANG) == pid) {
+            exited = TRUE;
+            drain_until = now + COMMAND_DRAIN_GRACE_MS;
+            fds[3].fd = -1;
+            // Anything the leader left behind in its group goes with it
+            if (outcome != 0) kill(-pid, SIGKILL);
+        }
+        
+        if (!exited && outcome == 0 && ((fds[4].revents & POLLIN) || now >= deadline)) {
+            outcome = (fds[4].revents & POLLIN) ? COMMAND_CANCELLED : COMMAND_TIMED_OUT;
+            kill(-pid, SIGTERM);
+            kill_at = now + COMMAND_KILL_GRACE_MS;
+            deadline = G_MAXINT64;
+            fds[4].fd = -1;
+        } else if (!exited && now >= kill_at) {
+            kill(-pid, SIGKILL);
+            kill_at = G_MAXINT64;
+        }
+    }
     
-    GString *result = g_string_new("");
-    gchar buffer[256];
+    for (gint i = 0; i < 3; i++) {
+        if (fds[i].fd >= 0) close(fds[i].fd);
+    }
+    if (fds[5].fd >= 0) close(fds[5].fd);
+    if (pidfd >= 0) close(pidfd);
+    
+    if (status_partial) {
+        if (status_partial->len > 0) request->status->line(request->status->user_data, status_partial->str, FALSE);
+        g_string_free(status_partial, TRUE);
+    }
+    
+    if (line_sink) {
+        for (gint i = 0; i < 2; i++) {
+            if (partial[i]->len > 0) line_sink->line(line_sink->user_data, partial[i]->str, i == 1);
+            g_string_free(partial[i], TRUE);
+        }
+    }
+    
+    // Only a failed poll leaves the loop with the child running. Nothing would enforce the
+    // timeout or a cancel on it any more, so it goes now instead of being waited on.
+    if (!exited) kill(-pid, SIGKILL);
+    while (!exited && waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return -1;
+    }
     
-    while (fgets(buffer, sizeof(buffer), pipe) != NULL) {
-        g_string_append(result, buffer);
+    if (outcome != 0) return outcome;
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return -1;
+}
+
+// Plain commands are spawned directly, only commands with pipes,
+// redirections or expansions go through /bin/sh
+static gchar **build_command_argv(const gchar *command) {
+    gchar **argv = NULL;
+    
+    if (strpbrk(command, SHELL_METACHARACTERS) == NULL &&
+        g_shell_parse_argv(command, NULL, &argv, NULL)) {
+        return argv;
     }
     
-    gint status = pclose(pipe);
+    argv = g_new0(gchar *, 4);
+    argv[0] = g_strdup("/bin/sh");
+    argv[1] = g_strdup("-c");
+    argv[2] = g_strdup(command);
+    return argv;
+}
+
+// pidfd for the child, or -1 on kernels before 5.3 where the caller falls back to polling waitpid
+static gint open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return (gint)syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    return -1;
+#endif
+}
+
+// Set up a token that is not cancelled
+static void init_cancel_token(CancelToken *token) {
+    token->cancelled = 0;
+    if (pipe2(token->fds, O_CLOEXEC | O_NONBLOCK) != 0) {
+        token->fds[0] = token->fds[1] = -1;
+    }
+}
+
+// Cancel every command watching the token, from any thread
+static void cancel_token_trigger(CancelToken *token) {
+    if (g_atomic_int_compare_and_exchange(&token->cancelled, 0, 1) && token->fds[1] >= 0) {
+        ssize_t written G_GNUC_UNUSED = write(token->fds[1], "x", 1);
+    }
+}
+
+// Make the token usable again once nothing watches it
+static void cancel_token_reset(CancelToken *token) {
+    gchar drain[16];
+    while (token->fds[0] >= 0 && read(token->fds[0], drain, sizeof(drain)) > 0) {
+    }
+    g_atomic_int_set(&token->cancelled, 0);
+}
+
+static gboolean cancel_token_is_cancelled(const CancelToken *token) {
+    return token && g_atomic_int_get(&token->cancelled);
+}
+
+static void clear_cancel_token(CancelToken *token) {
+    for (gint i = 0; i < 2; i++) {
+        if (token->fds[i] >= 0) close(token->fds[i]);
+        token->fds[i] = -1;
+    }
+}
+
+// Run command and capture stdout
+static gint run_command(const gchar *command, gchar **output) {
+    gchar **argv = build_command_argv(command);
+    
+    GString *result = output ? g_string_new(NULL) : NULL;
+    CommandRequest request = {
+        .argv = (const gchar *const *)argv,
+        .input = NULL,
+        .out = result,
+        .err = NULL,
+        .sink = NULL,
+        .timeout_ms = TIMEOUT_QUICK_S * 1000,
+        .cancel = app_data ? &app_data->cancel : NULL,
+        .status = NULL,
+    };
+    gint status = execute_command(&request);
     
     if (output) {
         *output = g_string_free(result, FALSE);
-    } else {
-        g_string_free(result, TRUE);
     }
     
+    g_strfreev(argv);
     return status;
 }
 
+// apt and dpkg flag problems with E: and W: prefixes, everything else is progress
+static StatusType classify_output_line(const gchar *line) {
+    if (g_str_has_prefix(line, "E: ") || g_str_has_prefix(line, "dpkg: error") ||
+        g_str_has_prefix(line, "Err:")) {
+        return STATUS_ERROR;
+    }
+    if (g_str_has_prefix(line, "W: ") || g_str_has_prefix(line, "dpkg: warning")) {
+        return STATUS_WARNING;
+    }
+    return STATUS_INFO;
+}
+
+// Queue one output line for the console and remember it for the failure report
+static void console_stream_line(gpointer user_data, const gchar *line, gboolean is_stderr) {
+    ConsoleStream *stream = (ConsoleStream *)user_data;
+    
+    g_strlcpy(stream->tail[stream->tail_next], line, LOG_EVENT_TEXT_MAX);
+    stream->tail_next = (stream->tail_next + 1) % OUTPUT_TAIL_LINES;
+    
+    StatusType type = classify_output_line(line);
+    journal_post_output(stream->app_data->journal, type, line, is_stderr);
+    post_output_line(stream->app_data, type, line);
+}
+
 // Run command with progress updates
-static gboolean run_command_with_progress(const gchar *command, AppData *data, gdouble progress_increment) {
-    ProgressUpdate *update = g_malloc(sizeof(ProgressUpdate));
-    update->app_data = data;
-    update->progress = 0.0;
-    update->message = NULL;
-    update->log_message = g_strdup_printf("Running: %s", command);
-    update->log_type = STATUS_INFO;
-    g_idle_add(update_progress_ui, update);
+static gboolean run_command_with_progress(const gchar *command, AppData *data, gint timeout_seconds,
+                                          gboolean as_root, const CommandSink *status) {
+    post_log_message(data, STATUS_INFO, "Running%s: %s", as_root ? " as root" : "", command);
+    journal_post(data->journal, JOURNAL_RECORD_STEP_BEGIN, STATUS_INFO, command);
+    
+    ConsoleStream stream = { .app_data = data };
+    CommandSink sink = { console_stream_line, &stream };
+    gchar **argv = build_command_argv(command);
+    CommandRequest request = {
+        .argv = (const gchar *const *)argv,
+        .input = NULL,
+        .out = NULL,
+        .err = NULL,
+        .sink = &sink,
+        .timeout_ms = timeout_seconds * 1000,
+        .cancel = &data->cancel,
+        .status = status,
+    };
+    
+    gint result = as_root ? execute_privileged(data->helper, &request) : execute_command(&request);
+    g_strfreev(argv);
+    journal_step_end(data->journal, command, result);
+    
+    if (result != 0 && result != COMMAND_CANCELLED) {
+        // The failing lines, even if the console dropped some of them while catching up
+        post_log_message(data, STATUS_ERROR, "Last output lines:");
+        for (guint i = 0; i < OUTPUT_TAIL_LINES; i++) {
+            const gchar *line = stream.tail[(stream.tail_next + i) % OUTPUT_TAIL_LINES];
+            if (line[0]) post_log_message(data, STATUS_ERROR, "    %s", line);
+        }
+    }
     
-    gint result = run_command(command, NULL);
+    if (result == COMMAND_CANCELLED) {
+        post_log_message(data, STATUS_WARNING, "Command cancelled: %s", command);
+        return FALSE;
+    }
     
     if (result == 0) {
-        update = g_malloc(sizeof(ProgressUpdate));
-        update->app_data = data;
-        update->progress = progress_increment;
-        update->message = NULL;
-        update->log_message = g_strdup("Command completed successfully");
-        update->log_type = STATUS_SUCCESS;
-        g_idle_add(update_progress_ui, update);
+        post_log_message(data, STATUS_SUCCESS, "Command completed successfully");
         return TRUE;
+    } else if (result == COMMAND_TIMED_OUT) {
+        post_log_message(data, STATUS_ERROR, "Command timed out after %d seconds", timeout_seconds);
+        return FALSE;
     } else {
-        update = g_malloc(sizeof(ProgressUpdate));
-        update->app_data = data;
-        update->progress = 0.0;
-        update->message = NULL;
-        update->log_message = g_strdup_printf("Command failed with exit code %d", result);
-        update->log_type = STATUS_ERROR;
-        g_idle_add(update_progress_ui, update);
+        post_log_message(data, STATUS_ERROR, "Command failed with exit code %d", result);
         return FALSE;
     }
 }
@@ -1099,78 +5557,517 @@ static gchar *get_sudo_password(GtkWidget *parent) {
     return password;
 }
 
-// Verify sudo access with password
-static gboolean verify_sudo_access(const gchar *password) {
-    if (!password) return FALSE;
+// Abstract socket address for the helper connection, nothing is created on disk
+static socklen_t helper_socket_address(const gchar *name, struct sockaddr_un *address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    gsize length = MIN(strlen(name), sizeof(address->sun_path) - 1);
+    memcpy(address->sun_path + 1, name, length);
+    return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + length);
+}
+
+// Send one frame. Callers hold the lock of their side of the connection.
+static gboolean helper_write_frame(gint fd, HelperFrameType type, guint32 request_id,
+                                   const void *payload, gsize length) {
+    HelperFrameHeader header = { (guint32)length, request_id, (guint32)type };
+    struct iovec parts[2] = {
+        { &header, sizeof(header) },
+        { (void *)payload, length },
+    };
+    struct msghdr message = { .msg_iov = parts, .msg_iovlen = length > 0 ? 2 : 1 };
+    
+    while (message.msg_iovlen > 0) {
+        ssize_t sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return FALSE;
+        }
+        
+        // A short send can stop inside either part
+        while (message.msg_iovlen > 0 && (gsize)sent >= message.msg_iov->iov_len) {
+            sent -= message.msg_iov->iov_len;
+            message.msg_iov++;
+            message.msg_iovlen--;
+        }
+        if (message.msg_iovlen > 0) {
+            message.msg_iov->iov_base = (gchar *)message.msg_iov->iov_base + sent;
+            message.msg_iov->iov_len -= sent;
+        }
+    }
+    return TRUE;
+}
+
+// Read exactly length bytes, FALSE on EOF or error
+static gboolean read_exact(gint fd, void *buffer, gsize length) {
+    gchar *position = buffer;
+    while (length > 0) {
+        ssize_t len = read(fd, position, length);
+        if (len < 0 && errno == EINTR) continue;
+        if (len <= 0) return FALSE;
+        position += len;
+        length -= len;
+    }
+    return TRUE;
+}
+
+// Receive one frame into payload, FALSE once the other side is gone
+static gboolean helper_read_frame(gint fd, HelperFrameHeader *header, GString *payload) {
+    if (!read_exact(fd, header, sizeof(*header)) || header->length > HELPER_FRAME_MAX) {
+        return FALSE;
+    }
+    g_string_set_size(payload, header->length);
+    return read_exact(fd, payload->str, header->length);
+}
+
+// Authenticate once and start the root helper. password is NULL when already running as root.
+// The helper connects back over an abstract socket because sudo closes inherited descriptors
+// and may put the command behind a pty.
+static PrivilegedHelper *start_privileged_helper(const gchar *password) {
+    gchar *exe = g_file_read_link("/proc/self/exe", NULL);
+    if (!exe) return NULL;
+    
+    gchar *name = g_strdup_printf("nvidia-setup-tool-%d-%08x%08x", (gint)getpid(), g_random_int(), g_random_int());
+    struct sockaddr_un address;
+    socklen_t address_length = helper_socket_address(name, &address);
+    gint listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&address, address_length) != 0 ||
+        listen(listen_fd, SOMAXCONN) != 0) {
+        if (listen_fd >= 0) close(listen_fd);
+        g_free(exe);
+        g_free(name);
+        return NULL;
+    }
+    
+    PrivilegedHelper *helper = g_malloc0(sizeof(PrivilegedHelper));
+    helper->socket_fd = -1;
+    g_mutex_init(&helper->lock);
+    g_cond_init(&helper->call_done);
+    helper->calls = g_hash_table_new(g_direct_hash, g_direct_equal);
+    helper->launch_err = g_string_new(NULL);
+    init_cancel_token(&helper->launch_cancel);
+    
+    GPtrArray *argv = g_ptr_array_new();
+    if (password) {
+        // -k checks the password now instead of trusting a cached sudo timestamp
+        const gchar *sudo_argv[] = { "sudo", "-k", "-S", "-p", "", "--" };
+        for (guint i = 0; i < G_N_ELEMENTS(sudo_argv); i++) {
+            g_ptr_array_add(argv, g_strdup(sudo_argv[i]));
+        }
+        helper->launch_input = g_strdup_printf("%s\n", password);
+    }
+    g_ptr_array_add(argv, exe);
+    g_ptr_array_add(argv, g_strdup(PRIVILEGED_HELPER_FLAG));
+    g_ptr_array_add(argv, name);
+    g_ptr_array_add(argv, NULL);
+    helper->launch_argv = (gchar **)g_ptr_array_free(argv, FALSE);
+    
+    if (pthread_create(&helper->launcher_thread, NULL, privileged_launcher_thread, helper) != 0) {
+        helper->launcher_thread = 0;
+        close(listen_fd);
+        stop_privileged_helper(helper);
+        return NULL;
+    }
+    
+    // Wait for the helper to connect, or for sudo to give up on the password. The socket name
+    // is listed in /proc/net/unix, so anyone may connect first; only root is kept.
+    gint64 deadline = g_get_monotonic_time() + HELPER_CONNECT_TIMEOUT_MS * 1000;
+    while (helper->socket_fd < 0 && !g_atomic_int_get(&helper->launch_finished) &&
+           g_get_monotonic_time() < deadline) {
+        struct pollfd pfd = { listen_fd, POLLIN, 0 };
+        if (poll(&pfd, 1, HELPER_CANCEL_POLL_MS) <= 0) continue;
+        
+        gint fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) continue;
+        struct ucred credentials;
+        socklen_t credentials_length = sizeof(credentials);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &credentials_length) == 0 &&
+            credentials.uid == 0) {
+            helper->socket_fd = fd;
+        } else {
+            close(fd);
+        }
+    }
+    close(listen_fd);
+    
+    gboolean ready = FALSE;
+    if (helper->socket_fd >= 0) {
+        HelperFrameHeader header;
+        GString *payload = g_string_new(NULL);
+        ready = helper_read_frame(helper->socket_fd, &header, payload) && header.type == HELPER_FRAME_HELLO;
+        g_string_free(payload, TRUE);
+    }
     
-    FILE *pipe = popen("sudo -S echo 'test' >/dev/null 2>&1", "w");
-    if (!pipe) return FALSE;
+    if (!ready) {
+        stop_privileged_helper(helper);
+        return NULL;
+    }
     
-    fputs(password, pipe);
-    fputs("\n", pipe);
-    fflush(pipe);
+    // sudo consumed the password before starting the helper
+    if (helper->launch_input) memset(helper->launch_input, 0, strlen(helper->launch_input));
     
-    gint status = pclose(pipe);
-    return (status == 0);
+    helper->alive = TRUE;
+    if (pthread_create(&helper->reader_thread, NULL, privileged_reader_thread, helper) != 0) {
+        helper->reader_thread = 0;
+        stop_privileged_helper(helper);
+        return NULL;
+    }
+    return helper;
 }
 
-// Clean up application data
-static void cleanup_app_data(AppData *data) {
-    if (!data) return;
+// Close the connection and wait for the helper to stop its commands and exit
+static void stop_privileged_helper(PrivilegedHelper *helper) {
+    if (!helper) return;
     
-    if (data->system_info.gpu_info) g_free(data->system_info.gpu_info);
-    if (data->system_info.driver_info) g_free(data->system_info.driver_info);
-    if (data->system_info.cuda_info) g_free(data->system_info.cuda_info);
-    if (data->system_info.distro_codename) g_free(data->system_info.distro_codename);
+    if (helper->socket_fd >= 0) {
+        shutdown(helper->socket_fd, SHUT_RDWR);
+    } else {
+        // Never connected, so sudo is still waiting or the helper is stuck
+        cancel_token_trigger(&helper->launch_cancel);
+    }
     
-    if (data->worker_thread) {
-        pthread_join(data->worker_thread, NULL);
+    if (helper->reader_thread) {
+        pthread_join(helper->reader_thread, NULL);
     }
+    if (helper->launcher_thread) {
+        pthread_join(helper->launcher_thread, NULL);
+    }
+    
+    if (helper->socket_fd >= 0) close(helper->socket_fd);
+    if (helper->launch_input) {
+        memset(helper->launch_input, 0, strlen(helper->launch_input));
+        g_free(helper->launch_input);
+    }
+    g_strfreev(helper->launch_argv);
+    g_string_free(helper->launch_err, TRUE);
+    clear_cancel_token(&helper->launch_cancel);
+    g_hash_table_destroy(helper->calls);
+    g_cond_clear(&helper->call_done);
+    g_mutex_clear(&helper->lock);
+    g_free(helper);
 }
 
-// Update progress UI from main thread
-static gboolean update_progress_ui(gpointer user_data) {
-    ProgressUpdate *update = (ProgressUpdate *)user_data;
-    if (!update || !update->app_data) return FALSE;
+static gboolean privileged_helper_alive(PrivilegedHelper *helper) {
+    if (!helper) return FALSE;
     
-    AppData *data = update->app_data;
+    g_mutex_lock(&helper->lock);
+    gboolean alive = helper->alive;
+    g_mutex_unlock(&helper->lock);
+    return alive;
+}
+
+// Runs sudo and the helper behind it for the whole session
+static void *privileged_launcher_thread(void *arg) {
+    PrivilegedHelper *helper = (PrivilegedHelper *)arg;
+    CommandRequest request = {
+        .argv = (const gchar *const *)helper->launch_argv,
+        .input = helper->launch_input,
+        .out = NULL,
+        .err = helper->launch_err,
+        .sink = NULL,
+        .timeout_ms = 0,
+        .cancel = &helper->launch_cancel,
+        .status = NULL,
+    };
+    
+    execute_command(&request);
+    g_atomic_int_set(&helper->launch_finished, 1);
+    return NULL;
+}
+
+// Hand helper output to the waiting callers' sinks and wake them when their command exits
+static void *privileged_reader_thread(void *arg) {
+    PrivilegedHelper *helper = (PrivilegedHelper *)arg;
+    HelperFrameHeader header;
+    GString *payload = g_string_new(NULL);
+    
+    while (helper_read_frame(helper->socket_fd, &header, payload)) {
+        g_mutex_lock(&helper->lock);
+        PrivilegedCall *call = g_hash_table_lookup(helper->calls, GUINT_TO_POINTER(header.request_id));
+        g_mutex_unlock(&helper->lock);
+        if (!call) continue;
+        
+        // Only this thread completes calls, so call stays valid until the EXIT frame
+        const CommandRequest *request = call->request;
+        if (header.type == HELPER_FRAME_STDOUT || header.type == HELPER_FRAME_STDERR) {
+            gboolean is_stderr = (header.type == HELPER_FRAME_STDERR);
+            GString *capture = is_stderr ? request->err : request->out;
+            if (capture) {
+                g_string_append_len(capture, payload->str, payload->len);
+                g_string_append_c(capture, '\n');
+            }
+            if (request->sink) request->sink->line(request->sink->user_data, payload->str, is_stderr);
+        } else if (header.type == HELPER_FRAME_STATUS) {
+            if (request->status) request->status->line(request->status->user_data, payload->str, FALSE);
+        } else if (header.type == HELPER_FRAME_EXIT && payload->len == sizeof(gint32)) {
+            g_mutex_lock(&helper->lock);
+            memcpy(&call->status, payload->str, sizeof(gint32));
+            call->done = TRUE;
+            g_hash_table_remove(helper->calls, GUINT_TO_POINTER(header.request_id));
+            g_cond_broadcast(&helper->call_done);
+            g_mutex_unlock(&helper->lock);
+        }
+    }
     
-    if (update->message) {
-        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(data->progress_bar), update->progress / 100.0);
-        gtk_progress_bar_set_text(GTK_PROGRESS_BAR(data->progress_bar), update->message);
-        gtk_label_set_text(GTK_LABEL(data->progress_label), update->message);
+    // The helper is gone, fail everything still waiting on it
+    g_mutex_lock(&helper->lock);
+    helper->alive = FALSE;
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, helper->calls);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        PrivilegedCall *call = (PrivilegedCall *)value;
+        call->status = -1;
+        call->done = TRUE;
     }
+    g_hash_table_remove_all(helper->calls);
+    g_cond_broadcast(&helper->call_done);
+    g_mutex_unlock(&helper->lock);
     
-    if (update->log_message) {
-        log_message(data, update->log_message, update->log_type);
+    g_string_free(payload, TRUE);
+    return NULL;
+}
+
+// Run a request as root through the helper. Same contract as execute_command, except that
+// input is not supported and captured output arrives line by line.
+static gint execute_privileged(PrivilegedHelper *helper, const CommandRequest *request) {
+    if (cancel_token_is_cancelled(request->cancel)) return COMMAND_CANCELLED;
+    
+    GString *payload = g_string_new(NULL);
+    guint32 timeout_ms = request->timeout_ms > 0 ? (guint32)request->timeout_ms : 0;
+    guint32 flags = request->status ? HELPER_RUN_STATUS_FD : 0;
+    g_string_append_len(payload, (const gchar *)&timeout_ms, sizeof(timeout_ms));
+    g_string_append_len(payload, (const gchar *)&flags, sizeof(flags));
+    for (gint i = 0; request->argv[i]; i++) {
+        g_string_append_len(payload, request->argv[i], strlen(request->argv[i]) + 1);
     }
     
-    if (update->message) g_free(update->message);
-    if (update->log_message) g_free(update->log_message);
-    g_free(update);
+    PrivilegedCall call = { request, -1, FALSE };
+    gboolean sent = FALSE;
+    gboolean cancel_sent = FALSE;
+    guint32 id = 0;
+    
+    if (helper) {
+        g_mutex_lock(&helper->lock);
+        if (helper->alive) {
+            id = ++helper->next_id;
+            g_hash_table_insert(helper->calls, GUINT_TO_POINTER(id), &call);
+            sent = helper_write_frame(helper->socket_fd, HELPER_FRAME_RUN, id, payload->str, payload->len);
+            if (!sent) g_hash_table_remove(helper->calls, GUINT_TO_POINTER(id));
+        }
+        
+        // The helper enforces the timeout; a cancel is forwarded and it kills the process group
+        while (sent && !call.done) {
+            if (!cancel_sent && cancel_token_is_cancelled(request->cancel)) {
+                helper_write_frame(helper->socket_fd, HELPER_FRAME_CANCEL, id, NULL, 0);
+                cancel_sent = TRUE;
+            }
+            g_cond_wait_until(&helper->call_done, &helper->lock,
+                              g_get_monotonic_time() + HELPER_CANCEL_POLL_MS * 1000);
+        }
+        g_mutex_unlock(&helper->lock);
+    }
     
-    return FALSE;
+    g_string_free(payload, TRUE);
+    if (!sent) {
+        if (request->err) g_string_append(request->err, "privileged helper is not running\n");
+        return -1;
+    }
+    return call.status;
 }
 
-// Update log UI from main thread
-static gboolean update_log_ui(gpointer user_data) {
-    gchar *log_data = (gchar *)user_data;
-    if (!log_data || !app_data) return FALSE;
+// Entry point of the root helper: runs commands for the app until it closes the connection
+static gint run_privileged_helper(const gchar *socket_name) {
+    if (geteuid() != 0) {
+        fprintf(stderr, "%s must run as root\n", PRIVILEGED_HELPER_FLAG);
+        return 1;
+    }
+    
+    signal(SIGPIPE, SIG_IGN);
+    // Nothing may stop to ask questions, there is no terminal
+    g_setenv("DEBIAN_FRONTEND", "noninteractive", TRUE);
+    prepare_journal_dir();
+    
+    struct sockaddr_un address;
+    socklen_t address_length = helper_socket_address(socket_name, &address);
+    gint fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, address_length) != 0) {
+        fprintf(stderr, "Cannot connect to %s: %s\n", socket_name, g_strerror(errno));
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    
+    // Only take commands from the user sudo authenticated
+    struct ucred credentials;
+    socklen_t credentials_length = sizeof(credentials);
+    const gchar *sudo_uid = g_getenv("SUDO_UID");
+    uid_t expected_uid = sudo_uid ? (uid_t)g_ascii_strtoull(sudo_uid, NULL, 10) : 0;
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &credentials_length) != 0 ||
+        (credentials.uid != 0 && credentials.uid != expected_uid)) {
+        fprintf(stderr, "Refusing connection from uid %u\n", (guint)credentials.uid);
+        close(fd);
+        return 1;
+    }
     
-    gchar **parts = g_strsplit(log_data, "|", 2);
-    if (g_strv_length(parts) == 2) {
-        StatusType type = STATUS_INFO;
-        if (strcmp(parts[0], "SUCCESS") == 0) type = STATUS_SUCCESS;
-        else if (strcmp(parts[0], "WARNING") == 0) type = STATUS_WARNING;
-        else if (strcmp(parts[0], "ERROR") == 0) type = STATUS_ERROR;
-        else if (strcmp(parts[0], "INFO") == 0) type = STATUS_INFO;
+    HelperServer server = { .socket_fd = fd };
+    g_mutex_init(&server.lock);
+    g_cond_init(&server.idle);
+    server.jobs = g_hash_table_new(g_direct_hash, g_direct_equal);
+    
+    pthread_attr_t detached;
+    pthread_attr_init(&detached);
+    pthread_attr_setdetachstate(&detached, PTHREAD_CREATE_DETACHED);
+    
+    helper_write_frame(fd, HELPER_FRAME_HELLO, 0, NULL, 0);
+    
+    HelperFrameHeader header;
+    GString *payload = g_string_new(NULL);
+    while (helper_read_frame(fd, &header, payload)) {
+        if (header.type == HELPER_FRAME_CANCEL) {
+            g_mutex_lock(&server.lock);
+            HelperJob *job = g_hash_table_lookup(server.jobs, GUINT_TO_POINTER(header.request_id));
+            if (job) cancel_token_trigger(&job->cancel);
+            g_mutex_unlock(&server.lock);
+            continue;
+        }
+        if (header.type != HELPER_FRAME_RUN || payload->len <= 2 * sizeof(guint32)) continue;
+        
+        HelperJob *job = g_malloc0(sizeof(HelperJob));
+        guint32 timeout_ms;
+        guint32 flags;
+        memcpy(&timeout_ms, payload->str, sizeof(timeout_ms));
+        memcpy(&flags, payload->str + sizeof(timeout_ms), sizeof(flags));
+        job->server = &server;
+        job->id = header.request_id;
+        job->timeout_ms = (gint)MIN(timeout_ms, (guint32)G_MAXINT);
+        job->status_fd = (flags & HELPER_RUN_STATUS_FD) != 0;
+        init_cancel_token(&job->cancel);
+        
+        GPtrArray *argv = g_ptr_array_new();
+        const gchar *end = payload->str + payload->len;
+        for (const gchar *arg = payload->str + 2 * sizeof(guint32); arg < end; arg += strlen(arg) + 1) {
+            g_ptr_array_add(argv, g_strdup(arg));
+        }
+        g_ptr_array_add(argv, NULL);
+        job->argv = (gchar **)g_ptr_array_free(argv, FALSE);
+        
+        g_mutex_lock(&server.lock);
+        g_hash_table_insert(server.jobs, GUINT_TO_POINTER(job->id), job);
+        g_mutex_unlock(&server.lock);
         
-        log_message(app_data, parts[1], type);
+        pthread_t thread;
+        if (pthread_create(&thread, &detached, helper_job_thread, job) != 0) {
+            gint32 status = -1;
+            g_mutex_lock(&server.lock);
+            g_hash_table_remove(server.jobs, GUINT_TO_POINTER(job->id));
+            helper_write_frame(fd, HELPER_FRAME_EXIT, job->id, &status, sizeof(status));
+            g_mutex_unlock(&server.lock);
+            clear_cancel_token(&job->cancel);
+            g_strfreev(job->argv);
+            g_free(job);
+        }
     }
     
-    g_strfreev(parts);
-    g_free(log_data);
-    return FALSE;
+    // The app went away: stop whatever is still running before exiting
+    g_mutex_lock(&server.lock);
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, server.jobs);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        cancel_token_trigger(&((HelperJob *)value)->cancel);
+    }
+    while (g_hash_table_size(server.jobs) > 0) {
+        g_cond_wait(&server.idle, &server.lock);
+    }
+    g_mutex_unlock(&server.lock);
+    
+    pthread_attr_destroy(&detached);
+    g_string_free(payload, TRUE);
+    g_hash_table_destroy(server.jobs);
+    g_cond_clear(&server.idle);
+    g_mutex_clear(&server.lock);
+    close(fd);
+    return 0;
+}
+
+// Helper side: run one command and report its output and result
+static void *helper_job_thread(void *arg) {
+    HelperJob *job = (HelperJob *)arg;
+    HelperServer *server = job->server;
+    CommandSink sink = { helper_job_line, job };
+    CommandSink status_sink = { helper_job_status_line, job };
+    CommandRequest request = {
+        .argv = (const gchar *const *)job->argv,
+        .input = NULL,
+        .out = NULL,
+        .err = NULL,
+        .sink = &sink,
+        .timeout_ms = job->timeout_ms,
+        .cancel = &job->cancel,
+        .status = job->status_fd ? &status_sink : NULL,
+    };
+    
+    gint32 status = execute_command(&request);
+    
+    g_mutex_lock(&server->lock);
+    helper_write_frame(server->socket_fd, HELPER_FRAME_EXIT, job->id, &status, sizeof(status));
+    g_hash_table_remove(server->jobs, GUINT_TO_POINTER(job->id));
+    if (g_hash_table_size(server->jobs) == 0) g_cond_signal(&server->idle);
+    g_mutex_unlock(&server->lock);
+    
+    clear_cancel_token(&job->cancel);
+    g_strfreev(job->argv);
+    g_free(job);
+    return NULL;
+}
+
+static void helper_job_line(gpointer user_data, const gchar *line, gboolean is_stderr) {
+    HelperJob *job = (HelperJob *)user_data;
+    g_mutex_lock(&job->server->lock);
+    helper_write_frame(job->server->socket_fd, is_stderr ? HELPER_FRAME_STDERR : HELPER_FRAME_STDOUT,
+                       job->id, line, strlen(line));
+    g_mutex_unlock(&job->server->lock);
+}
+
+static void helper_job_status_line(gpointer user_data, const gchar *line, gboolean is_stderr) {
+    (void)is_stderr;
+    HelperJob *job = (HelperJob *)user_data;
+    g_mutex_lock(&job->server->lock);
+    helper_write_frame(job->server->socket_fd, HELPER_FRAME_STATUS, job->id, line, strlen(line));
+    g_mutex_unlock(&job->server->lock);
+}
+
+// Clean up application data
+static void cleanup_app_data(AppData *data) {
+    if (!data) return;
+    
+    if (data->worker_thread) {
+        // Whatever the worker is running gets killed, so the join cannot hang
+        cancel_token_trigger(&data->cancel);
+        pthread_join(data->worker_thread, NULL);
+    }
+    
+    if (data->system_info.gpu_info) g_free(data->system_info.gpu_info);
+    if (data->system_info.gpus) g_array_unref(data->system_info.gpus);
+    if (data->system_info.driver_info) g_free(data->system_info.driver_info);
+    g_free(data->system_info.driver_kernel_version);
+    g_free(data->system_info.driver_userspace_version);
+    if (data->system_info.cuda_info) g_free(data->system_info.cuda_info);
+    if (data->system_info.cuda_toolkits) g_array_unref(data->system_info.cuda_toolkits);
+    if (data->system_info.distro_codename) g_free(data->system_info.distro_codename);
+    g_free(data->system_info.os_id);
+    g_free(data->system_info.os_version_id);
+    g_free(data->system_info.os_id_like);
+    g_free(data->system_info.upstream_codename);
+    g_free(data->system_info.nvidia_repo_id);
+    
+    stop_privileged_helper(data->helper);
+    journal_close(data->journal);
+    clear_cancel_token(&data->cancel);
+    console_store_clear(&data->console_store);
+    if (data->console_filter.rows) g_array_free(data->console_filter.rows, TRUE);
+    if (data->console_filter.regex) g_regex_unref(data->console_filter.regex);
+    g_free(data->console_filter.query);
+    if (data->console_layout) g_object_unref(data->console_layout);
 }
 
 // Wrapper functions for g_idle_add
@@ -1180,9 +6077,37 @@ static gboolean set_widget_sensitive_wrapper(gpointer data) {
     return FALSE;
 }
 
-static gboolean update_status_display_wrapper(gpointer data) {
+static gboolean set_widget_insensitive_wrapper(gpointer data) {
+    GtkWidget *widget = (GtkWidget *)data;
+    gtk_widget_set_sensitive(widget, FALSE);
+    return FALSE;
+}
+
+static gboolean update_gpu_card_wrapper(gpointer data) {
+    AppData *app_data = (AppData *)data;
+    update_status_card(app_data->gpu_icon_label, app_data->gpu_status_label,
+                      app_data->system_info.gpu_detected ? "[OK]" : "[FAIL]",
+                      app_data->system_info.gpu_info,
+                      app_data->system_info.gpu_detected ? STATUS_SUCCESS : STATUS_ERROR);
+    return FALSE;
+}
+
+static gboolean update_driver_card_wrapper(gpointer data) {
     AppData *app_data = (AppData *)data;
-    update_status_display(app_data);
+    gboolean driver_ok = app_data->system_info.driver_installed && !app_data->system_info.driver_version_mismatch;
+    update_status_card(app_data->driver_icon_label, app_data->driver_status_label,
+                      driver_ok ? "[OK]" : "[WARN]",
+                      app_data->system_info.driver_info,
+                      driver_ok ? STATUS_SUCCESS : STATUS_WARNING);
+    return FALSE;
+}
+
+static gboolean update_cuda_card_wrapper(gpointer data) {
+    AppData *app_data = (AppData *)data;
+    update_status_card(app_data->cuda_icon_label, app_data->cuda_status_label,
+                      app_data->system_info.cuda_installed ? "[OK]" : "[INFO]",
+                      app_data->system_info.cuda_info,
+                      app_data->system_info.cuda_installed ? STATUS_SUCCESS : STATUS_INFO);
     return FALSE;
 }
 
@@ -1204,6 +6129,13 @@ static gboolean show_completion_dialog_wrapper(gpointer data) {
     return FALSE;
 }
 
+static gboolean show_auth_error_dialog_wrapper(gpointer data) {
+    AppData *app_data = (AppData *)data;
+    show_error_dialog(app_data->main_window, "Error", 
+                     "Invalid password or insufficient privileges.");
+    return FALSE;
+}
+
 static gboolean show_error_dialog_wrapper(gpointer data) {
     AppData *app_data = (AppData *)data;
     show_error_dialog(app_data->main_window, "Installation Failed", 